@@ -0,0 +1,760 @@
+#define RSA_NO_MAIN
+#include "multiple.c"
+
+/**
+ * Benchmarks for the bignum arithmetic in multiple.c, which is included directly so
+ * that this stays a single file build as well:
+ *
+ *   gcc -O2 -pthread -o benchmark benchmark.c
+ *
+ * For each operand size this times the school method, one level of Karatsuba and one
+ * level of Toom-3 (with the sub products going through the usual dispatch), for both
+ * multiplication and squaring. The smallest size where a method wins is a good value
+ * for KARATSUBA_THRESHOLD or TOOM3_THRESHOLD (and the _SQUARE_ versions) on this machine.
+ * It also counts the heap allocations made by a modular exponentiation once the scratch
+ * stack is warm, which should be zero, compares the fixed width exponentiation for
+ * the standard key sizes against the generic one and the batched SIMD one, and times
+ * prime generation under each of the primality tests. Before any of that the vector school
+ * multiplication kernels are checked against the portable one, and the fixed width and
+ * batched exponentiations against the generic and scalar ones, and the run stops if any of
+ * them disagree.
+ *
+ *   ./benchmark --json [file]
+ *
+ * runs the regression suite instead and writes it to file (or standard output) as JSON:
+ * multiplication, division, exponentiation, gcd and inverses on operands of 256 to 8192
+ * bits, prime generation up to 4096 bits, and encryption and decryption throughput with
+ * keys of 256 to 8192 bits. Every case seeds rand() from its own name and size, so the
+ * operands, primes and keys are the same from run to run and from build to build. Most of
+ * the few minutes this takes go on the 4096 and 8192 bit cases.
+ */
+
+#define MIN_SECONDS 0.2
+
+/* Each suite timing is the median of SUITE_SAMPLES runs of at least SUITE_SECONDS */
+#define SUITE_SAMPLES 5
+#define SUITE_SECONDS 0.05
+/* Blocks per encryption and decryption in the suite, enough for every thread and lane */
+#define SUITE_BLOCKS 64
+/* Goes up when the cases change, timings from different versions do not compare */
+#define SUITE_VERSION 2
+/* Bases each exponentiation check tries, see checkBases */
+#define CHECK_BASES 6
+
+int SIZES[] = {8, 12, 16, 24, 32, 48, 64, 96, 128, 160, 192, 256, 384, 512};
+int FIXED_BITS[] = {512, 1024, 1536, 2048, 3072, 4096};
+char* PRIMALITY_NAMES[] = {"solovay-strassen", "miller-rabin", "baillie-psw"};
+int KERNEL_SIZES[] = {16, 24, 32, 48, 64, 128, 256};
+int SUITE_BITS[] = {256, 512, 1024, 2048, 4096, 8192};
+/* Primes found per size, none past 4096 bits where one search takes minutes */
+int SUITE_PRIMES[] = {16, 8, 4, 2, 1, 0};
+
+/* School multiplication kernels, the portable reference first */
+#ifdef SIMD_X86
+void (*KERNELS[])(word*, word*, int, word*, int) = {bignum_portablemultiply, bignum_avx2multiply, bignum_ifmamultiply};
+char* KERNEL_NAMES[] = {"portable", "avx2", "ifma"};
+#else
+void (*KERNELS[])(word*, word*, int, word*, int) = {bignum_portablemultiply};
+char* KERNEL_NAMES[] = {"portable"};
+#endif
+#define KERNEL_COUNT ((int)(sizeof(KERNELS) / sizeof(KERNELS[0])))
+
+/**
+ * Operands for one case of the suite and the files the stream cases go through.
+ */
+typedef struct _suiteCase {
+	bignum *a, *b, *m, *result, *remainder;
+	bignum *e, *n;
+	privateKey* key;
+	FILE *plain, *cipher, *decoded;
+	int bytes;
+} suiteCase;
+
+/**
+ * Fill b with n random words. The top word is made nonzero so the length is exact.
+ */
+void randomBignum(bignum* b, int n) {
+	int i, j;
+	if(b->capacity < n) {
+		b->capacity = n;
+		b->data = realloc(b->data, b->capacity * sizeof(word));
+	}
+	for(i = 0; i < n; i++) {
+		b->data[i] = 0;
+		for(j = 0; j < WORD_BITS; j += 8) b->data[i] |= (word)(rand() & 0xff) << j;
+	}
+	if(b->data[n - 1] == 0) b->data[n - 1] = 1;
+	b->length = n;
+}
+
+/**
+ * Whether the processor can run kernel i of KERNELS.
+ */
+int kernelSupported(int i) {
+#ifdef SIMD_X86
+	if(i == 1) return __builtin_cpu_supports("avx2");
+	if(i == 2) return __builtin_cpu_supports("avx512ifma");
+#endif
+	return 1;
+}
+
+/**
+ * Compare every supported kernel with bignum_portablemultiply on operands of all lengths
+ * from 1 to 300 words against each other, random ones and ones with every bit set (the
+ * largest column sums). Returns the number of mismatches.
+ */
+int checkKernels(void) {
+	bignum *b1 = bignum_init(), *b2 = bignum_init(), *expected = bignum_init(), *actual = bignum_init();
+	int i, j, k, n1, n2, bad = 0;
+	for(i = 0; i < 2000; i++) {
+		n1 = 1 + (i < 1000 ? i % 40 : rand() % 300);
+		n2 = 1 + (i < 1000 ? i / 40 % 40 : rand() % 300);
+		randomBignum(b1, n1);
+		randomBignum(b2, n2);
+		if(i % 4 == 0) for(j = 0; j < n1; j++) b1->data[j] = ~(word)0;
+		if(i % 8 == 0) for(j = 0; j < n2; j++) b2->data[j] = ~(word)0;
+		bignum_reserve(expected, n1 + n2);
+		bignum_reserve(actual, n1 + n2);
+		bignum_portablemultiply(expected->data, b1->data, n1, b2->data, n2);
+		for(k = 1; k < KERNEL_COUNT; k++) {
+			if(!kernelSupported(k)) continue;
+			KERNELS[k](actual->data, b1->data, n1, b2->data, n2);
+			if(memcmp(expected->data, actual->data, (n1 + n2) * sizeof(word)) != 0) {
+				printf("Kernel %s disagrees with the portable one for %d by %d words\n", KERNEL_NAMES[k], n1, n2);
+				bad++;
+			}
+		}
+	}
+	bignum_deinit(b1);
+	bignum_deinit(b2);
+	bignum_deinit(expected);
+	bignum_deinit(actual);
+	return bad;
+}
+
+/**
+ * Fill bases with the CHECK_BASES bases the exponentiation checks use for modulus m of n
+ * words: 0, m - 1, m, m + 1, a random one below m and a random one of twice the length.
+ */
+void checkBases(bignum** bases, bignum* modulus, int n) {
+	bignum_fromint(bases[0], 0);
+	bignum_subtract(bases[1], modulus, &NUMS[1]);
+	bignum_copy(modulus, bases[2]);
+	bignum_add(bases[3], modulus, &NUMS[1]);
+	randomBignum(bases[4], n - 1);
+	randomBignum(bases[5], 2 * n);
+}
+
+/**
+ * Compare the fixed width exponentiation with the generic one at every width in FIXED_BITS,
+ * for a random modulus and one with every bit set, each of the checkBases and exponents of
+ * 0, 1 and one random word. The random base below m also gets a full width exponent.
+ * Returns the number of mismatches.
+ */
+int checkFixed(void) {
+	bignum *modulus = bignum_init(), *exponent = bignum_init(), *expected = bignum_init(), *actual = bignum_init();
+	bignum* bases[CHECK_BASES];
+	bignum_mont *generic, *fixed;
+	int i, j, k, n, bad = 0;
+	for(j = 0; j < CHECK_BASES; j++) bases[j] = bignum_init();
+	for(i = 0; i < 2 * (int)(sizeof(FIXED_BITS) / sizeof(FIXED_BITS[0])); i++) {
+		n = FIXED_WORDS(FIXED_BITS[i / 2]);
+		randomBignum(modulus, n);
+		if(i % 2 == 1) for(j = 0; j < n; j++) modulus->data[j] = ~(word)0;
+		modulus->data[0] |= 1;
+		fixedWidth = 0;
+		generic = bignum_mont_init(modulus);
+		fixedWidth = 1;
+		fixed = bignum_mont_init(modulus);
+		checkBases(bases, modulus, n);
+		for(j = 0; j < CHECK_BASES; j++) {
+			for(k = 0; k < (j == 4 ? 4 : 3); k++) {
+				if(k < 2) bignum_fromint(exponent, k);
+				else randomBignum(exponent, k == 2 ? 1 : n);
+				bignum_mont_modpow(generic, bases[j], exponent, expected);
+				bignum_mont_modpow(fixed, bases[j], exponent, actual);
+				if(!bignum_equal(expected, actual)) {
+					printf("Fixed width exponentiation disagrees with the generic one at %d bits for base %d, exponent %d\n",
+						FIXED_BITS[i / 2], j, k);
+					bad++;
+				}
+			}
+		}
+		bignum_mont_deinit(generic);
+		bignum_mont_deinit(fixed);
+	}
+	for(j = 0; j < CHECK_BASES; j++) bignum_deinit(bases[j]);
+	bignum_deinit(modulus);
+	bignum_deinit(exponent);
+	bignum_deinit(expected);
+	bignum_deinit(actual);
+	return bad;
+}
+
+/**
+ * Compare bignum_batch_modpow with bignum_modpow at every width in FIXED_BITS, for each
+ * lane count the processor supports and every number of bases from one to a full batch.
+ * The bases are the checkBases and random ones below the modulus, rotated so partly filled
+ * batches see each of them. Full batches get a full width exponent, the others a single
+ * random word to keep this quick. Returns the number of mismatches.
+ */
+int checkBatch(void) {
+	bignum *modulus = bignum_init(), *exponent = bignum_init();
+	bignum *bases[BATCH_LANES], *lane[BATCH_LANES], *expected[BATCH_LANES], *results[BATCH_LANES];
+	bignum_mont* mont;
+	bignum_batch* batch;
+	int i, j, n, lanes, count, bad = 0;
+	for(j = 0; j < BATCH_LANES; j++) {
+		bases[j] = bignum_init();
+		expected[j] = bignum_init();
+		results[j] = bignum_init();
+	}
+	for(i = 0; i < (int)(sizeof(FIXED_BITS) / sizeof(FIXED_BITS[0])); i++) {
+		n = FIXED_WORDS(FIXED_BITS[i]);
+		randomBignum(modulus, n);
+		modulus->data[0] |= 1;
+		checkBases(bases, modulus, n);
+		for(j = CHECK_BASES; j < BATCH_LANES; j++) randomBignum(bases[j], n - 1);
+		mont = bignum_mont_init(modulus);
+		for(lanes = 1; lanes <= BATCH_LANES; lanes *= 2) {
+			if(lanes == 2) continue;
+			batchLanes = lanes;
+			batch = bignum_batch_init(mont);
+			for(count = 1; batch->lanes == lanes && count <= lanes; count++) {
+				randomBignum(exponent, count == lanes ? n : 1);
+				for(j = 0; j < count; j++) lane[j] = bases[(j + count) % BATCH_LANES];
+				bignum_batch_modpow(batch, lane, exponent, results, count);
+				for(j = 0; j < count; j++) {
+					bignum_modpow(lane[j], exponent, modulus, expected[j]);
+					if(!bignum_equal(expected[j], results[j])) {
+						printf("Batched exponentiation disagrees with the scalar one at %d bits in lane %d of %d with %d bases\n",
+							FIXED_BITS[i], j, lanes, count);
+						bad++;
+					}
+				}
+			}
+			bignum_batch_deinit(batch);
+		}
+		bignum_mont_deinit(mont);
+	}
+	batchLanes = 0;
+	for(j = 0; j < BATCH_LANES; j++) {
+		bignum_deinit(bases[j]);
+		bignum_deinit(expected[j]);
+		bignum_deinit(results[j]);
+	}
+	bignum_deinit(modulus);
+	bignum_deinit(exponent);
+	return bad;
+}
+
+/**
+ * Print one row of nanoseconds per n by n word product for each supported kernel.
+ */
+void benchmarkKernels(int n) {
+	bignum *b1 = bignum_init(), *b2 = bignum_init(), *result = bignum_init();
+	long reps, batch, i;
+	int k;
+	clock_t start, elapsed;
+	randomBignum(b1, n);
+	randomBignum(b2, n);
+	bignum_reserve(result, 2 * n);
+	printf("%6d %6d", n, n * WORD_BITS);
+	for(k = 0; k < KERNEL_COUNT; k++) {
+		if(!kernelSupported(k)) {
+			printf(" %10s", "-");
+			continue;
+		}
+		reps = 0;
+		batch = 1;
+		start = clock();
+		do {
+			for(i = 0; i < batch; i++) KERNELS[k](result->data, b1->data, n, b2->data, n);
+			reps += batch;
+			batch *= 2;
+			elapsed = clock() - start;
+		}
+		while(elapsed < MIN_SECONDS * CLOCKS_PER_SEC);
+		printf(" %10.0f", elapsed * 1e9 / CLOCKS_PER_SEC / reps);
+	}
+	printf("\n");
+	bignum_deinit(b1);
+	bignum_deinit(b2);
+	bignum_deinit(result);
+}
+
+/**
+ * Time a multiplication method on b1 * b2 (a squaring if b1 == b2). The operation is
+ * repeated until at least MIN_SECONDS have passed, returns microseconds per operation.
+ */
+double timeMultiply(void (*method)(bignum*, bignum*, bignum*), bignum* b1, bignum* b2) {
+	bignum* result = bignum_init();
+	long reps = 0, batch = 1, i;
+	clock_t start = clock(), elapsed;
+	do {
+		for(i = 0; i < batch; i++) method(result, b1, b2);
+		reps += batch;
+		batch *= 2;
+		elapsed = clock() - start;
+	}
+	while(elapsed < MIN_SECONDS * CLOCKS_PER_SEC);
+	bignum_deinit(result);
+	return elapsed * 1e6 / CLOCKS_PER_SEC / reps;
+}
+
+/**
+ * Squaring entry point with the same signature as the multiplication methods, b2 is the
+ * same operand as b1 and goes unused.
+ */
+void schoolSquare(bignum* result, bignum* b1, bignum* b2) {
+	(void)b2;
+	bignum_schoolsquare(result, b1);
+}
+
+/**
+ * Print one row of the crossover table for operands of n words.
+ */
+void benchmarkSize(int n, int square) {
+	bignum *b1 = bignum_init(), *b2 = bignum_init();
+	double school, karatsuba, toom3;
+	int threshold = toom3Threshold, squareThreshold = toom3SquareThreshold;
+	randomBignum(b1, n);
+	randomBignum(b2, n);
+	if(square) b2 = b1;
+	/* Only the top level split is forced, below it the current thresholds apply */
+	school = timeMultiply(square ? schoolSquare : bignum_schoolmultiply, b1, b2);
+	toom3Threshold = toom3SquareThreshold = INT_MAX;
+	karatsuba = timeMultiply(bignum_karatsuba, b1, b2);
+	toom3Threshold = threshold;
+	toom3SquareThreshold = squareThreshold;
+	toom3 = timeMultiply(bignum_toom3, b1, b2);
+	printf("%6d %6d %12.2f %12.2f %12.2f   %s\n", n, n * WORD_BITS, school, karatsuba, toom3,
+		school <= karatsuba && school <= toom3 ? "school" : karatsuba <= toom3 ? "karatsuba" : "toom3");
+	bignum_deinit(b1);
+	if(!square) bignum_deinit(b2);
+}
+
+/**
+ * Print the average number of heap allocations made by a modular exponentiation with an n
+ * word modulus and exponent, after a first run has warmed up the scratch stack.
+ */
+void benchmarkAllocations(int n) {
+	bignum *base = bignum_init(), *exponent = bignum_init();
+	bignum *modulus = bignum_init(), *result = bignum_init();
+	bignum_mont* mont;
+	unsigned long before;
+	int i, reps = 10;
+	randomBignum(modulus, n);
+	modulus->data[0] |= 1;
+	randomBignum(base, n - 1);
+	randomBignum(exponent, n);
+	mont = bignum_mont_init(modulus);
+	bignum_mont_modpow(mont, base, exponent, result);
+	before = bignumAllocations;
+	for(i = 0; i < reps; i++) bignum_mont_modpow(mont, base, exponent, result);
+	printf("%6d %6d %12.1f\n", n, n * WORD_BITS, (double)(bignumAllocations - before) / reps);
+	bignum_mont_deinit(mont);
+	bignum_deinit(base);
+	bignum_deinit(exponent);
+	bignum_deinit(modulus);
+	bignum_deinit(result);
+}
+
+/**
+ * Time a full length exponentiation modulo a random modulus of the given number of bits,
+ * returns microseconds per operation.
+ */
+double timeModpow(bignum* base, bignum* exponent, bignum* modulus) {
+	bignum* result = bignum_init();
+	bignum_mont* mont = bignum_mont_init(modulus);
+	long reps = 0;
+	clock_t start = clock(), elapsed;
+	do {
+		bignum_mont_modpow(mont, base, exponent, result);
+		reps++;
+		elapsed = clock() - start;
+	}
+	while(elapsed < MIN_SECONDS * CLOCKS_PER_SEC);
+	bignum_mont_deinit(mont);
+	bignum_deinit(result);
+	return elapsed * 1e6 / CLOCKS_PER_SEC / reps;
+}
+
+/**
+ * Print one row comparing the generic and fixed width exponentiation for a modulus of the
+ * given number of bits.
+ */
+void benchmarkFixed(int bits) {
+	bignum *base = bignum_init(), *exponent = bignum_init(), *modulus = bignum_init();
+	double generic, fixed;
+	randomBignum(modulus, FIXED_WORDS(bits));
+	modulus->data[0] |= 1;
+	randomBignum(base, FIXED_WORDS(bits) - 1);
+	randomBignum(exponent, FIXED_WORDS(bits));
+	fixedWidth = 0;
+	generic = timeModpow(base, exponent, modulus);
+	fixedWidth = 1;
+	fixed = timeModpow(base, exponent, modulus);
+	printf("%6d %12.0f %12.0f %8.2f\n", bits, generic, fixed, generic / fixed);
+	bignum_deinit(base);
+	bignum_deinit(exponent);
+	bignum_deinit(modulus);
+}
+
+/**
+ * Print one row of the time per exponentiation when a full batch of numbers is exponentiated
+ * at once, for each lane count up to what the processor supports. One lane is the scalar
+ * (fixed width where there is one) path.
+ */
+void benchmarkBatch(int bits) {
+	bignum *exponent = bignum_init(), *modulus = bignum_init();
+	bignum *bases[BATCH_LANES], *results[BATCH_LANES];
+	bignum_mont* mont;
+	bignum_batch* batch;
+	int i, lanes;
+	long reps;
+	clock_t start, elapsed;
+	randomBignum(modulus, FIXED_WORDS(bits));
+	modulus->data[0] |= 1;
+	randomBignum(exponent, FIXED_WORDS(bits));
+	for(i = 0; i < BATCH_LANES; i++) {
+		bases[i] = bignum_init();
+		results[i] = bignum_init();
+		randomBignum(bases[i], FIXED_WORDS(bits) - 1);
+	}
+	mont = bignum_mont_init(modulus);
+	printf("%6d", bits);
+	for(lanes = 1; lanes <= BATCH_LANES; lanes *= 2) {
+		if(lanes == 2) continue;
+		batchLanes = lanes;
+		batch = bignum_batch_init(mont);
+		if(batch->lanes == lanes) {
+			reps = 0;
+			start = clock();
+			do {
+				bignum_batch_modpow(batch, bases, exponent, results, lanes);
+				reps += lanes;
+				elapsed = clock() - start;
+			}
+			while(elapsed < MIN_SECONDS * CLOCKS_PER_SEC);
+			printf(" %12.0f", elapsed * 1e6 / CLOCKS_PER_SEC / reps);
+		}
+		else printf(" %12s", "-");
+		bignum_batch_deinit(batch);
+	}
+	printf("\n");
+	batchLanes = 0;
+	bignum_mont_deinit(mont);
+	for(i = 0; i < BATCH_LANES; i++) {
+		bignum_deinit(bases[i]);
+		bignum_deinit(results[i]);
+	}
+	bignum_deinit(exponent);
+	bignum_deinit(modulus);
+}
+
+/**
+ * Print the average time to generate a random prime of (about) the given number of bits
+ * with each primality test, on one thread. Every test sees the same starting points.
+ */
+void benchmarkPrimes(int bits, int count) {
+	bignum* p = bignum_init();
+	int i, test, digits = (int)(bits * 0.30103) + 1; /* 10^(digits - 1) is just under 2^bits */
+	double start;
+	printf("%6d", bits);
+	for(test = PRIMALITY_SOLOVAY_STRASSEN; test <= PRIMALITY_BAILLIE_PSW; test++) {
+		primalityTest = test;
+		srand(bits);
+		start = wallSeconds();
+		for(i = 0; i < count; i++) randPrime(digits, p);
+		printf(" %18.3f", (wallSeconds() - start) / count);
+	}
+	printf("\n");
+	primalityTest = PRIMALITY_MILLER_RABIN;
+	bignum_deinit(p);
+}
+
+/* The operations the suite times, one call each */
+void suiteMultiply(suiteCase* c) {
+	bignum_multiply(c->result, c->a, c->b);
+}
+
+void suiteDivide(suiteCase* c) {
+	bignum_divide(c->result, c->remainder, c->a, c->b);
+}
+
+void suiteModpow(suiteCase* c) {
+	bignum_modpow(c->a, c->b, c->m, c->result);
+}
+
+void suiteGcd(suiteCase* c) {
+	bignum_gcd(c->a, c->b, c->result);
+}
+
+void suiteInverse(suiteCase* c) {
+	bignum_inverse(c->a, c->m, c->result);
+}
+
+void suiteEncrypt(suiteCase* c) {
+	rewind(c->plain);
+	rewind(c->cipher);
+	encryptStream(c->plain, c->cipher, c->bytes, c->e, c->n);
+	fflush(c->cipher);
+}
+
+void suiteDecrypt(suiteCase* c) {
+	rewind(c->cipher);
+	rewind(c->decoded);
+	decryptStream(c->cipher, c->decoded, c->bytes, c->key);
+	fflush(c->decoded);
+}
+
+/**
+ * Seed rand() from a case name and size, so a case sees the same numbers whatever ran
+ * before it.
+ */
+void suiteSeed(char* name, int bits) {
+	unsigned int seed = (unsigned int)bits;
+	while(*name) seed = seed * 31 + (unsigned char)*name++;
+	srand(seed);
+}
+
+int compareDoubles(const void* a, const void* b) {
+	double x = *(const double*)a, y = *(const double*)b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * Time op on c, returns the median microseconds per call over SUITE_SAMPLES runs, each
+ * repeating it until SUITE_SECONDS of wall time have passed. reps receives the total
+ * number of calls. Wall time rather than clock() since the stream cases use every thread.
+ */
+double suiteTime(void (*op)(suiteCase*), suiteCase* c, long* reps) {
+	double samples[SUITE_SAMPLES], start, elapsed;
+	long count;
+	int i;
+	*reps = 0;
+	op(c); /* Warm up the scratch stack and caches */
+	for(i = 0; i < SUITE_SAMPLES; i++) {
+		count = 0;
+		start = wallSeconds();
+		do {
+			op(c);
+			count++;
+			elapsed = wallSeconds() - start;
+		}
+		while(elapsed < SUITE_SECONDS);
+		samples[i] = elapsed * 1e6 / count;
+		*reps += count;
+	}
+	qsort(samples, SUITE_SAMPLES, sizeof(double), compareDoubles);
+	return samples[SUITE_SAMPLES / 2];
+}
+
+/**
+ * Write one result object to the JSON array, after a comma unless it is the first. extra
+ * holds any further fields, each starting with a comma.
+ */
+void suiteResult(FILE* out, int* first, char* name, int bits, double micros, long reps, char* extra) {
+	fprintf(out, "%s\n    {\"name\": \"%s\", \"bits\": %d, \"us_per_op\": %.3f, \"reps\": %ld%s}",
+		*first ? "" : ",", name, bits, micros, reps, extra);
+	*first = 0;
+}
+
+/**
+ * Time the arithmetic primitives on random operands of the given number of bits: n by n
+ * products, 2n by n division, n bit exponentiation, gcd and an inverse modulo an n bit
+ * number.
+ */
+void suiteArithmetic(FILE* out, int* first, int bits) {
+	suiteCase c;
+	long reps;
+	double micros;
+	int n = bits / WORD_BITS;
+	c.a = bignum_init();
+	c.b = bignum_init();
+	c.m = bignum_init();
+	c.result = bignum_init();
+	c.remainder = bignum_init();
+	suiteSeed("multiply", bits);
+	randomBignum(c.a, n);
+	randomBignum(c.b, n);
+	micros = suiteTime(suiteMultiply, &c, &reps);
+	suiteResult(out, first, "multiply", bits, micros, reps, "");
+	suiteSeed("divide", bits);
+	randomBignum(c.a, 2 * n);
+	randomBignum(c.b, n);
+	micros = suiteTime(suiteDivide, &c, &reps);
+	suiteResult(out, first, "divide", bits, micros, reps, "");
+	suiteSeed("modpow", bits);
+	randomBignum(c.m, n);
+	c.m->data[0] |= 1;
+	randomBignum(c.a, n - 1);
+	randomBignum(c.b, n);
+	micros = suiteTime(suiteModpow, &c, &reps);
+	suiteResult(out, first, "modpow", bits, micros, reps, "");
+	suiteSeed("gcd", bits);
+	randomBignum(c.a, n);
+	randomBignum(c.b, n);
+	micros = suiteTime(suiteGcd, &c, &reps);
+	suiteResult(out, first, "gcd", bits, micros, reps, "");
+	/* An even modulus like phi, and a number coprime to it */
+	suiteSeed("inverse", bits);
+	randomBignum(c.m, n);
+	c.m->data[0] &= ~(word)1;
+	randomBignum(c.a, n - 1);
+	c.a->data[0] |= 1;
+	for(bignum_gcd(c.a, c.m, c.result); !bignum_equal(c.result, &NUMS[1]); bignum_gcd(c.a, c.m, c.result)) {
+		bignum_iadd(c.a, &NUMS[2]);
+	}
+	micros = suiteTime(suiteInverse, &c, &reps);
+	suiteResult(out, first, "inverse", bits, micros, reps, "");
+	bignum_deinit(c.a);
+	bignum_deinit(c.b);
+	bignum_deinit(c.m);
+	bignum_deinit(c.result);
+	bignum_deinit(c.remainder);
+}
+
+/**
+ * Time count prime searches of the given number of bits on one thread, so the candidates
+ * tried (and the primes found) only depend on the seed.
+ */
+void suitePrimes(FILE* out, int* first, int bits, int count) {
+	bignum* p = bignum_init();
+	double seconds, total = 0;
+	long candidates, tried = 0;
+	char extra[64];
+	int i;
+	threadCount = 1;
+	suiteSeed("prime", bits);
+	for(i = 0; i < count; i++) {
+		randPrimes(1, (int)(bits * 0.30103) + 1, &p, &seconds, &candidates);
+		total += seconds;
+		tried += candidates;
+	}
+	threadCount = 0;
+	sprintf(extra, ", \"candidates\": %ld", tried);
+	suiteResult(out, first, "prime", bits, total * 1e6 / count, count, extra);
+	bignum_deinit(p);
+}
+
+/**
+ * Generate a key of the given number of bits from a fixed seed (on one thread, so it
+ * is always the same key), then time encrypting SUITE_BLOCKS blocks of random bytes
+ * through encryptStream and decrypting them back through decryptStream. Returns 0 if the
+ * decrypted message differs from the original.
+ */
+int suiteStreams(FILE* out, int* first, int bits) {
+	suiteCase c;
+	bignum *p = bignum_init(), *q = bignum_init(), *d = bignum_init();
+	unsigned char *original, *decoded;
+	long reps, len;
+	double micros;
+	char extra[64];
+	int i, same;
+	c.e = bignum_init();
+	c.n = bignum_init();
+	threadCount = 1;
+	suiteSeed("key", bits);
+	generateKey(bits, c.n, c.e, d, p, q);
+	threadCount = 0;
+	c.key = initPrivateKey(p, q, d);
+	c.bytes = (bignum_bitlength(c.n) - 1) / packBits;
+	len = (long)c.bytes * SUITE_BLOCKS;
+	original = malloc(len);
+	decoded = malloc(len);
+	for(i = 0; i < len; i++) original[i] = rand() & 0xff;
+	c.plain = tmpfile();
+	c.cipher = tmpfile();
+	c.decoded = tmpfile();
+	fwrite(original, 1, len, c.plain);
+	fflush(c.plain);
+	micros = suiteTime(suiteEncrypt, &c, &reps);
+	sprintf(extra, ", \"bytes\": %ld, \"mb_per_s\": %.3f", len, len / micros);
+	suiteResult(out, first, "encrypt", bits, micros, reps, extra);
+	micros = suiteTime(suiteDecrypt, &c, &reps);
+	sprintf(extra, ", \"bytes\": %ld, \"mb_per_s\": %.3f", len, len / micros);
+	suiteResult(out, first, "decrypt", bits, micros, reps, extra);
+	rewind(c.decoded);
+	same = readFully(c.decoded, decoded, len) == (size_t)len && memcmp(original, decoded, len) == 0;
+	fclose(c.plain);
+	fclose(c.cipher);
+	fclose(c.decoded);
+	free(original);
+	free(decoded);
+	deinitPrivateKey(c.key);
+	bignum_deinit(c.e);
+	bignum_deinit(c.n);
+	bignum_deinit(p);
+	bignum_deinit(q);
+	bignum_deinit(d);
+	return same;
+}
+
+/**
+ * Run the regression suite and write it to out as JSON, see the top of this file. Returns
+ * 0 if a decryption did not give back the message.
+ */
+int runSuite(FILE* out) {
+	int i, first = 1, ok = 1, count = (int)(sizeof(SUITE_BITS) / sizeof(SUITE_BITS[0]));
+	char* kernel = "portable";
+	for(i = 0; i < KERNEL_COUNT; i++) if(schoolKernel == KERNELS[i]) kernel = KERNEL_NAMES[i];
+	fprintf(out, "{\n  \"suite\": \"rsa\",\n  \"version\": %d,\n", SUITE_VERSION);
+	fprintf(out, "  \"word_bits\": %d,\n  \"kernel\": \"%s\",\n  \"threads\": %d,\n", WORD_BITS, kernel, workerThreads());
+	fprintf(out, "  \"samples\": %d,\n  \"results\": [", SUITE_SAMPLES);
+	for(i = 0; i < count; i++) suiteArithmetic(out, &first, SUITE_BITS[i]);
+	for(i = 0; i < count; i++) if(SUITE_PRIMES[i] > 0) suitePrimes(out, &first, SUITE_BITS[i], SUITE_PRIMES[i]);
+	for(i = 0; i < count; i++) ok &= suiteStreams(out, &first, SUITE_BITS[i]);
+	fprintf(out, "\n  ]\n}\n");
+	return ok;
+}
+
+int main(int argc, char** argv) {
+	int i, square;
+	FILE* out = stdout;
+	srand(1); /* Fixed seed so runs are comparable */
+	if(checkKernels() + checkFixed() + checkBatch() > 0) return EXIT_FAILURE;
+	if(argc > 1 && strcmp(argv[1], "--json") == 0) {
+		if(argc > 2 && (out = fopen(argv[2], "w")) == NULL) {
+			fprintf(stderr, "Failed to open file \"%s\"\n", argv[2]);
+			return EXIT_FAILURE;
+		}
+		i = runSuite(out);
+		if(out != stdout) fclose(out);
+		if(!i) fprintf(stderr, "Decryption did not give back the message\n");
+		return i ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+	for(i = 0; i < KERNEL_COUNT; i++) if(schoolKernel == KERNELS[i]) printf("School multiplication kernel: %s\n\n", KERNEL_NAMES[i]);
+	printf("School multiplication kernels, nanoseconds per operation\n");
+	printf("%6s %6s", "words", "bits");
+	for(i = 0; i < KERNEL_COUNT; i++) printf(" %10s", KERNEL_NAMES[i]);
+	printf("\n");
+	for(i = 0; i < (int)(sizeof(KERNEL_SIZES) / sizeof(KERNEL_SIZES[0])); i++) benchmarkKernels(KERNEL_SIZES[i]);
+	printf("\n");
+	for(square = 0; square <= 1; square++) {
+		printf("%s, microseconds per operation\n", square ? "Squaring" : "Multiplication");
+		printf("%6s %6s %12s %12s %12s   %s\n", "words", "bits", "school", "karatsuba", "toom3", "best");
+		for(i = 0; i < (int)(sizeof(SIZES) / sizeof(SIZES[0])); i++) benchmarkSize(SIZES[i], square);
+		printf("\n");
+	}
+	printf("Heap allocations per modpow after warm up\n");
+	printf("%6s %6s %12s\n", "words", "bits", "allocations");
+	for(i = 0; i < (int)(sizeof(SIZES) / sizeof(SIZES[0])) && SIZES[i] <= 256; i++) benchmarkAllocations(SIZES[i]);
+	printf("\n");
+	printf("Modular exponentiation, microseconds per operation\n");
+	printf("%6s %12s %12s %8s\n", "bits", "generic", "fixed", "speedup");
+	for(i = 0; i < (int)(sizeof(FIXED_BITS) / sizeof(FIXED_BITS[0])); i++) benchmarkFixed(FIXED_BITS[i]);
+	printf("\n");
+	printf("Batched exponentiation, microseconds per operation\n");
+	printf("%6s %12s %12s %12s\n", "bits", "1 lane", "4 lanes", "8 lanes");
+	for(i = 0; i < (int)(sizeof(FIXED_BITS) / sizeof(FIXED_BITS[0])); i++) benchmarkBatch(FIXED_BITS[i]);
+	printf("\n");
+	printf("Prime generation, seconds per prime\n");
+	printf("%6s %18s %18s %18s\n", "bits", PRIMALITY_NAMES[0], PRIMALITY_NAMES[1], PRIMALITY_NAMES[2]);
+	threadCount = 1;
+	benchmarkPrimes(1024, 4);
+	benchmarkPrimes(2048, 2);
+	threadCount = 0;
+	return EXIT_SUCCESS;
+}
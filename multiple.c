@@ -3,36 +3,246 @@
 #include <time.h>
 #include <string.h>
 #include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 /* Accuracy with which we test for prime numbers using Solovay-Strassen algorithm.
- * 20 Tests should be sufficient for most largish primes */
+ * 20 Tests should be sufficient for most largish primes. The other tests are run to at
+ * least the same confidence, see probablePrime. */
 #define ACCURACY 20
 
+/* Primality tests probablePrime can use, chosen through primalityTest */
+#define PRIMALITY_SOLOVAY_STRASSEN 0
+#define PRIMALITY_MILLER_RABIN 1
+#define PRIMALITY_BAILLIE_PSW 2
+
 #define FACTOR_DIGITS 100
 #define EXPONENT_MAX RAND_MAX
 #define BUF_SIZE 1024
 
+/* Blocks encryptStream and decryptStream work on at a time. Their buffers hold this many
+ * blocks however long the stream is, and it is enough blocks to keep the threads busy. */
+#define STREAM_BLOCKS 256
+
+/* Cryptogram formats encryptStream can write, chosen through cipherFormat. The binary one
+ * starts with a CIPHER_HEADER byte header opening with CIPHER_MAGIC, see encryptStream. */
+#define CIPHER_DECIMAL 0
+#define CIPHER_BINARY 1
+#define CIPHER_MAGIC "RSAB"
+#define CIPHER_VERSION 1
+#define CIPHER_HEADER 28
+
+/* Key files, see writeKey. The first line holds the magic and KEY_VERSION, each after it
+ * the name and decimal value of one number. Values may have up to KEY_DIGITS digits,
+ * which is enough for keys of over 30000 bits. */
+#define KEY_PUBLIC "rsa-public-key"
+#define KEY_PRIVATE "rsa-private-key"
+#define KEY_VERSION 1
+#define KEY_DIGITS 10000
+
+/* Blocks the bench command encrypts and decrypts when not told how many */
+#define BENCH_BLOCKS 256
+
+/* Compile with -DRSA_STATS to count the calls, limbs and heap allocations of each bignum
+ * primitive, time every encrypted and decrypted block and the phases of key generation,
+ * and print it all to stderr at exit, see statsDump. Without it the STATS_ macros below
+ * compile to nothing. */
+#define STAT_OTHER 0
+#define STAT_ADD 1
+#define STAT_SUBTRACT 2
+#define STAT_MULTIPLY 3
+#define STAT_SQUARE 4
+#define STAT_DIVIDE 5
+#define STAT_MODPOW 6
+#define STAT_BATCH_MODPOW 7
+#define STAT_GCD 8
+#define STAT_INVERSE 9
+#define STAT_JACOBI 10
+#define STAT_PRIMITIVES 11
+
+/* Block latency histograms, and the number of buckets in each, see statsBucket */
+#define STAT_ENCODE 0
+#define STAT_DECODE 1
+#define STAT_HISTOGRAMS 2
+#define STAT_BUCKETS 256
+
+/* Timed phases of a run */
+#define STAT_PRIMES 0
+#define STAT_MODULUS 1
+#define STAT_EXPONENT 2
+#define STAT_PRIVATE 3
+#define STAT_ENCRYPT 4
+#define STAT_DECRYPT 5
+#define STAT_PHASES 6
+
+#ifdef RSA_STATS
+/* Goes first in a primitive, declaring what STATS_LEAVE needs to hand back to the caller */
+#define STATS_ENTER(primitive, limbs) int statOuter = statsEnter(primitive, limbs);
+#define STATS_LEAVE() (statPrimitive = statOuter)
+#define STATS_ALLOCATE(count) statsAdd(&statCounters[statPrimitive].allocations, count)
+#define STATS_BLOCK_START() (statBlockStart = wallSeconds())
+#define STATS_BLOCK_END(histogram, count) statsBlocks(histogram, count)
+#define STATS_PHASE_START() (statPhaseStart = wallSeconds())
+#define STATS_PHASE_END(phase) statsPhase(phase)
+#else
+#define STATS_ENTER(primitive, limbs)
+#define STATS_LEAVE() ((void)0)
+#define STATS_ALLOCATE(count) ((void)0)
+#define STATS_BLOCK_START() ((void)0)
+#define STATS_BLOCK_END(histogram, count) ((void)0)
+#define STATS_PHASE_START() ((void)0)
+#define STATS_PHASE_END(phase) ((void)0)
+#endif
+
 /* Initial capacity for a bignum structure. They will flexibly expand but this
  * should be reasonably high to avoid frequent early reallocs */
 #define BIGNUM_CAPACITY 20
 
-/* Radix and halfradix. These should be changed if the limb/word type changes */
-#define RADIX 4294967296UL
-#define HALFRADIX 2147483648UL
+/* Compile with -DWORD64 to use 64 bit limbs, with unsigned __int128 (GCC and Clang) for
+ * intermediate products. This halves the number of limbs for a given key size. */
+#ifdef WORD64
+#define WORD_BITS 64
+#else
+#define WORD_BITS 32
+#endif
+
+/* Decimal conversion works in chunks of the largest power of ten that fits in a word */
+#ifdef WORD64
+#define DECIMAL_DIGITS 19
+#define DECIMAL_BASE 10000000000000000000ULL
+#else
+#define DECIMAL_DIGITS 9
+#define DECIMAL_BASE 1000000000U
+#endif
+
+/* Radix and halfradix. These follow the limb/word type chosen below */
+#define RADIX ((dword)1 << WORD_BITS)
+#define HALFRADIX ((word)1 << (WORD_BITS - 1))
+
+/* Operand lengths, in words, from which multiplication switches from the school method to
+ * Karatsuba and from Karatsuba to Toom-3. School squaring does half the work of a school
+ * multiply so it stays ahead for longer. The best values depend on the machine, run
+ * benchmark.c to find the crossover points. They can also be changed at runtime through
+ * the variables of the same name in lower camel case. The _DEFAULT flags record which ones
+ * were left to these values, bignum_dispatch only raises those. */
+#ifndef KARATSUBA_THRESHOLD
+#define KARATSUBA_THRESHOLD 32
+#define KARATSUBA_THRESHOLD_DEFAULT
+#endif
+#ifndef TOOM3_THRESHOLD
+#define TOOM3_THRESHOLD 192
+#define TOOM3_THRESHOLD_DEFAULT
+#endif
+#ifndef KARATSUBA_SQUARE_THRESHOLD
+#define KARATSUBA_SQUARE_THRESHOLD 128
+#define KARATSUBA_SQUARE_THRESHOLD_DEFAULT
+#endif
+#ifndef TOOM3_SQUARE_THRESHOLD
+#define TOOM3_SQUARE_THRESHOLD 384
+#define TOOM3_SQUARE_THRESHOLD_DEFAULT
+#endif
+
+/* Number of odd primes (3, 5, 7, ..) that prime search candidates are sieved by before the
+ * probable prime test. With 2048 of them (up to 17863) about 88% of odd candidates are
+ * thrown out by the sieve. */
+#define SIEVE_PRIMES 2048
+
+/* Length in words from which decimal conversion splits the number in two around a cached
+ * power of ten rather than working through it a chunk at a time. See bignum_tostring and
+ * bignum_fromstring. With schoolbook division the split only starts to pay for reading
+ * at a few thousand words and not yet for printing, so this is well above key sizes. */
+#ifndef DECIMAL_THRESHOLD
+#define DECIMAL_THRESHOLD 4096
+#endif
+
+/* Largest sliding window width used by modpow, the table of odd powers has 2^(k-1) entries */
+#define WINDOW_MAX 6
+
+/* Number of words in a fixed width integer of the given number of bits, see BIGNUM_FIXED */
+#define FIXED_WORDS(bits) ((bits) / WORD_BITS)
+
+/* The fixed width kernels are written once with the width as a parameter and inlined into
+ * a function per width, so the compiler sees constant loop bounds and can unroll the inner
+ * loops (which -O2 alone does not do). */
+#ifdef __GNUC__
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+#define UNROLL _Pragma("GCC unroll 8")
+#else
+#define ALWAYS_INLINE static inline
+#define UNROLL
+#endif
+
+/* Storage class for per thread state, each thread gets its own scratch stack */
+#ifdef __GNUC__
+#define THREAD_LOCAL __thread
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
+/* School multiplication and batched exponentiation have AVX2 and AVX-512 kernels on x86-64,
+ * picked at run time from what the processor supports. Each kernel is compiled for its
+ * instruction set through a target attribute, so the file still builds and runs without
+ * any -m flags. */
+#if defined(__GNUC__) && defined(__x86_64__)
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+/* Shorter operand length, in words, from which bignum_schoolmultiply uses the vector kernel
+ * rather than the portable one, whose loop has less to set up. bignum_schoolsquare, which
+ * does half the work of a multiply, switches over at VECTOR_SQUARE_THRESHOLD. */
+#ifndef VECTOR_THRESHOLD
+#ifdef WORD64
+#define VECTOR_THRESHOLD 20
+#else
+#define VECTOR_THRESHOLD 16
+#endif
+#endif
+#ifndef VECTOR_SQUARE_THRESHOLD
+#define VECTOR_SQUARE_THRESHOLD (2 * VECTOR_THRESHOLD)
+#endif
+
+/* Rows of the vector school multiplication kernels done per pass over the accumulators */
+#define VECTOR_ROWS 4
+
+/* Operand size, in bits, from which Karatsuba beats school multiplication on top of each
+ * vector kernel. bignum_dispatch raises karatsubaThreshold and karatsubaSquareThreshold to
+ * these when it picks the kernel, and the Toom-3 ones to twice as much, unless they were
+ * set at compile time. */
+#ifndef IFMA_KARATSUBA_BITS
+#define IFMA_KARATSUBA_BITS 24576
+#endif
+#ifndef AVX2_KARATSUBA_BITS
+#define AVX2_KARATSUBA_BITS 8192
+#endif
+
+/* Most numbers bignum_batch_modpow works on at once, one per 64 bit lane of a 512 bit vector */
+#define BATCH_LANES 8
 
 #define MAX(a,b) ((a) > (b) ? (a) : (b))
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
 
 /**
  * Basic limb type. Note that some calculations rely on unsigned overflow wrap-around of this type.
- * As a result, only unsigned types should be used here, and the RADIX, HALFRADIX above should be
- * changed as necessary. Unsigned integer should probably be the most efficient word type, and this
- * is used by GMP for example.
+ * As a result, only unsigned types should be used here. dword must hold the product of two words
+ * plus two more words, and is used for all intermediate products. Unsigned integer is the portable
+ * choice, but on 64 bit hosts 64 bit limbs do a quarter of the single precision multiplies (GMP
+ * uses the native register width for example).
  */
+#ifdef WORD64
+typedef unsigned long long word;
+typedef unsigned __int128 dword;
+#else
 typedef unsigned int word;
+typedef unsigned long long dword;
+#endif
 
 /**
  * Structure for representing multiple precision integers. This is a base "word" LSB
- * representation. In this case the base, word, is 2^32. Length is the number of words
+ * representation. In this case the base, word, is 2^WORD_BITS. Length is the number of words
  * in the current representation. Length should not allow for trailing zeros (Things like
  * 000124). The capacity is the number of words allocated for the limb data.
  */
@@ -42,21 +252,200 @@ typedef struct _bignum {
 	word* data;
 } bignum;
 
+/**
+ * A stack of bignums for temporaries. top is the number in use and capacity the number
+ * that have been allocated.
+ */
+typedef struct _bignum_scratch {
+	int top;
+	int capacity;
+	bignum** stack;
+} bignum_scratch;
+
+/**
+ * Context for Montgomery multiplication modulo an odd modulus of n words. Values in the
+ * Montgomery domain are stored as aR mod modulus, where R = RADIX^n. The product of two
+ * such values only needs a REDC step (word shifts and single precision multiplies) to get
+ * back into the domain, so no long division is done after the context is set up. The
+ * context is not modified after setup, so threads can share it.
+ */
+typedef struct _bignum_mont {
+	bignum* modulus;
+	bignum* r2; /* R^2 mod modulus, for converting into the Montgomery domain */
+	word minv; /* -modulus^-1 mod RADIX */
+	/* Fixed width exponentiation for moduli of a standard size, otherwise NULL */
+	void (*fixedpow)(struct _bignum_mont* mont, bignum* base, bignum* exponent, bignum* result);
+} bignum_mont;
+
+/**
+ * One digit of a batched number, see bignum_batch.
+ */
+typedef unsigned long long batchword;
+
+/**
+ * Context for exponentiating up to "lanes" numbers at once modulo the modulus of a
+ * Montgomery context, one number per SIMD lane. Numbers are held as "digits" digits of
+ * "bits" bits, digit j of lane l at index j * lanes + l, so one vector load picks up the
+ * same digit of every lane. The digits are short enough for a whole Montgomery product to
+ * build up in 64 bit lanes before any carries are propagated, and R = 2^(bits * digits) is
+ * above 4 * modulus so values can stay below 2 * modulus without a final subtraction after
+ * each product. With a single lane there is no vector kernel and bignum_batch_modpow runs
+ * bignum_mont_modpow on each number. Like bignum_mont it is not modified after setup.
+ */
+typedef struct _bignum_batch {
+	bignum_mont* mont;
+	int lanes, digits, bits;
+	batchword mask; /* 2^bits - 1 */
+	batchword minv; /* -modulus^-1 mod 2^bits */
+	batchword *modulus, *r2, *one; /* Every digit repeated across the lanes */
+	void (*multiply)(struct _bignum_batch* batch, batchword* r, batchword* a, batchword* b, batchword* t);
+} bignum_batch;
+
+/**
+ * RSA private key. Besides the private exponent this keeps the prime factors of the
+ * modulus so that decryption can use the chinese remainder theorem, with
+ * dp = d mod (p - 1), dq = d mod (q - 1) and qinv = q^-1 mod p. Montgomery and batch
+ * contexts for p and q are set up once with the key rather than for every block.
+ */
+typedef struct _privateKey {
+	bignum *n, *d, *p, *q;
+	bignum *dp, *dq, *qinv;
+	bignum_mont *montp, *montq;
+	bignum_batch *batchp, *batchq;
+} privateKey;
+
+/**
+ * A range of blocks [next, end) owned by one worker of a block pool. The owner takes
+ * blocks from the front, idle workers steal the back half.
+ */
+typedef struct _blockRange {
+	int next;
+	int end;
+	pthread_mutex_t lock;
+} blockRange;
+
+/**
+ * The worker threads of parallelBlocks, started as they are first needed and then kept
+ * for the life of the process. Each call is a round: the caller fills in the ranges, work
+ * and context, bumps round and wakes the workers, and work(context, block) is called
+ * exactly once for every block. Workers 1 to threads - 1 take part (the caller is worker
+ * 0), and busy counts those still running. lock guards round and busy, calls keeps
+ * concurrent callers of parallelBlocks apart.
+ */
+typedef struct _blockPool {
+	int threads;
+	int started;
+	int round;
+	int busy;
+	blockRange* ranges;
+	void (*work)(void* context, int block);
+	void* context;
+	pthread_mutex_t lock;
+	pthread_mutex_t calls;
+	pthread_cond_t wake;
+	pthread_cond_t done;
+} blockPool;
+
+/**
+ * Argument for a worker thread of the block pool. round is the last round it has seen.
+ */
+typedef struct _blockWorker {
+	blockPool* pool;
+	int id;
+	int round;
+} blockWorker;
+
+/**
+ * State shared by the threads searching for one random prime. Worker i of n tests the
+ * candidates start + 2i, start + 2i + 2n, .. and the first probable prime found wins, the
+ * other workers stop between rounds of the test they are running. found is read and
+ * candidates counted atomically, lock is only taken to publish the result.
+ */
+typedef struct _primeSearch {
+	bignum* start;
+	bignum* result;
+	int workers;
+	int found;
+	long candidates; /* Number of candidates that got past the sieve so far */
+	double started; /* Wall clock time the search started, see wallSeconds */
+	double seconds; /* Time taken to find the prime */
+	pthread_mutex_t lock;
+} primeSearch;
+
+/**
+ * Argument for a worker thread of a prime search. Each has its own random seed for
+ * picking witnesses.
+ */
+typedef struct _primeWorker {
+	primeSearch* search;
+	int id;
+	unsigned int seed;
+} primeWorker;
+
+/**
+ * What encryptStream and decryptStream hand to their block workers. Each group of lanes
+ * blocks only writes its own entries of blocks or its own bytes of decoded.
+ */
+typedef struct _messageJob {
+	int bytes;
+	int count; /* Blocks in this run, taken lanes at a time */
+	int lanes;
+	unsigned char* message;
+	bignum* exponent;
+	bignum_mont* mont;
+	bignum_batch* batch;
+	privateKey* key;
+	bignum* blocks;
+	unsigned char* decoded;
+} messageJob;
+
+/**
+ * Counts for one bignum primitive, see STAT_ADD etc.
+ */
+typedef struct _statCounter {
+	unsigned long long calls, limbs, allocations;
+} statCounter;
+
+/**
+ * Latencies in nanoseconds, bucketed by statsBucket, and the largest seen.
+ */
+typedef struct _statHistogram {
+	unsigned long long counts[STAT_BUCKETS];
+	unsigned long long total, max;
+} statHistogram;
+
 /**
  * Some forward delcarations as this was requested to be a single file.
  * See specific functions for explanations.
  */
+void bignum_fromint(bignum* b, word num);
+int bignum_less(bignum* b1, bignum* b2);
 void bignum_iadd(bignum* source, bignum* add);
 void bignum_add(bignum* result, bignum* b1, bignum* b2);
 void bignum_isubtract(bignum* source, bignum* add);
 void bignum_subtract(bignum* result, bignum* b1, bignum* b2);
 void bignum_imultiply(bignum* source, bignum* add);
 void bignum_multiply(bignum* result, bignum* b1, bignum* b2);
+void bignum_schoolmultiply(bignum* result, bignum* b1, bignum* b2);
+void bignum_portablemultiply(word* r, word* a, int na, word* b, int nb);
+void bignum_karatsuba(bignum* result, bignum* b1, bignum* b2);
+void bignum_toom3(bignum* result, bignum* b1, bignum* b2);
+void bignum_isquare(bignum* source);
+void bignum_square(bignum* result, bignum* b);
+void bignum_schoolsquare(bignum* result, bignum* b);
 void bignum_idivide(bignum* source, bignum* div);
 void bignum_idivider(bignum* source, bignum* div, bignum* remainder);
 void bignum_remainder(bignum* source, bignum *div, bignum* remainder);
 void bignum_imodulate(bignum* source, bignum* modulus);
 void bignum_divide(bignum* quotient, bignum* remainder, bignum* b1, bignum* b2);
+word bignum_modword(bignum* b, word div);
+int bignum_ctz(bignum* b);
+int bignum_testbit(bignum* b, int i);
+int bignum_bitlength(bignum* b);
+void bignum_irshift(bignum* b, int bits);
+void bignum_ilshift(bignum* b, int bits);
+void (*bignum_fixedpow(int words))(bignum_mont*, bignum*, bignum*, bignum*);
+double wallSeconds();
 
 /**
  * Save some frequently used bigintegers (0 - 10) so they do not need to be repeatedly
@@ -71,6 +460,235 @@ bignum NUMS[11] = {{1, 1, DATA0},{1, 1, DATA1},{1, 1, DATA2},
                    {1, 1, DATA6},{1, 1, DATA7},{1, 1, DATA8},
                    {1, 1, DATA9},{1, 1, DATA10}};
 
+/**
+ * Scratch stack that the arithmetic routines take their temporaries from, see bignum_push.
+ * Every thread has its own.
+ */
+THREAD_LOCAL bignum_scratch SCRATCH = {0, 0, NULL};
+
+/**
+ * Number of heap allocations (malloc, calloc or realloc) made for bignums so far by this
+ * thread. With the scratch stack warmed up this should not move during an exponentiation.
+ */
+THREAD_LOCAL unsigned long bignumAllocations = 0;
+
+int karatsubaThreshold = KARATSUBA_THRESHOLD;
+int toom3Threshold = TOOM3_THRESHOLD;
+int karatsubaSquareThreshold = KARATSUBA_SQUARE_THRESHOLD;
+int toom3SquareThreshold = TOOM3_SQUARE_THRESHOLD;
+
+/**
+ * Kernel bignum_schoolmultiply uses for operands of at least VECTOR_THRESHOLD words,
+ * r = a * b in na + nb words. bignum_dispatch replaces the portable one with the best
+ * vector kernel the processor supports at startup. Setting it back to
+ * bignum_portablemultiply forces the reference code.
+ */
+void (*schoolKernel)(word* r, word* a, int na, word* b, int nb) = bignum_portablemultiply;
+
+/**
+ * Whether new Montgomery contexts pick up the fixed width kernels for standard modulus
+ * sizes. Clearing this forces the generic path, for comparing the two.
+ */
+int fixedWidth = 1;
+
+/**
+ * Lanes new batch contexts use, see bignum_batch_init. 0 picks the widest vectors the
+ * processor supports, 1 forces the scalar path and 4 stops at AVX2.
+ */
+int batchLanes = 0;
+
+/**
+ * Number of threads encryptStream and decryptStream spread their blocks over. 0 uses one
+ * per online processor, 1 does all the work in the calling thread. Build with -pthread.
+ */
+int threadCount = 0;
+
+/**
+ * Bits of each message byte packed into a block by encryptStream and decryptStream. 8 keeps
+ * arbitrary binary data intact, 7 is the original packing for ASCII text.
+ */
+int packBits = 8;
+
+/**
+ * Format encryptStream writes the cryptogram in, one of the CIPHER_ values. decryptStream
+ * reads either.
+ */
+int cipherFormat = CIPHER_BINARY;
+
+/**
+ * Which primality test probablePrime runs, one of the PRIMALITY_ values.
+ */
+int primalityTest = PRIMALITY_MILLER_RABIN;
+
+/**
+ * Powers of ten 10^(DECIMAL_DIGITS * 2^k) for decimal conversion, computed as they are
+ * first needed. The lock guards decimalPowers and the list.
+ */
+bignum* DECIMAL_POWERS[32];
+int decimalPowers = 0;
+pthread_mutex_t decimalLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * The pool of block workers behind parallelBlocks.
+ */
+blockPool blockWorkers = {0, 0, 0, 0, NULL, NULL, NULL, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+/**
+ * The first SIEVE_PRIMES odd primes, filled in by initSmallPrimes.
+ */
+word SMALL_PRIMES[SIEVE_PRIMES];
+int smallPrimesReady = 0;
+
+/**
+ * State for threadRand, every thread has its own. 0 means not seeded yet.
+ */
+THREAD_LOCAL unsigned int randomSeed = 0;
+
+/**
+ * Flag probablePrime checks between rounds on each thread, see primeCancelled. A prime
+ * search points it at its found flag so that its workers stop once another has won.
+ */
+THREAD_LOCAL int* primeCancel = NULL;
+
+#ifdef RSA_STATS
+/**
+ * Counters for each primitive and STAT_OTHER, shared by all threads and updated atomically.
+ * Calls a primitive makes to another are counted for both, heap allocations only for the
+ * innermost primitive running, which is statPrimitive on each thread.
+ */
+statCounter statCounters[STAT_PRIMITIVES];
+THREAD_LOCAL int statPrimitive = STAT_OTHER;
+char* STAT_NAMES[] = {"other", "add", "subtract", "multiply", "square", "divide", "modpow",
+	"batch_modpow", "gcd", "inverse", "jacobi"};
+
+/**
+ * Per block latencies of encryption and decryption, timed on each thread from
+ * STATS_BLOCK_START, and wall seconds spent in each phase since STATS_PHASE_START.
+ */
+statHistogram statHistograms[STAT_HISTOGRAMS];
+THREAD_LOCAL double statBlockStart;
+char* STAT_HISTOGRAM_NAMES[] = {"encode", "decode"};
+double statPhases[STAT_PHASES];
+double statPhaseStart;
+char* STAT_PHASE_NAMES[] = {"primes", "modulus", "exponent", "private key", "encrypt", "decrypt"};
+
+/**
+ * Add to a counter that other threads may be adding to.
+ */
+void statsAdd(unsigned long long* counter, unsigned long long value) {
+	__atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+/**
+ * Count a call of primitive on operands of limbs words in all, and charge heap allocations
+ * to it until STATS_LEAVE. A primitive calling itself (the Karatsuba and Toom-3 recursion
+ * goes back through bignum_multiply) is only counted once. Returns the primitive that was
+ * running.
+ */
+int statsEnter(int primitive, long limbs) {
+	int outer = statPrimitive;
+	if(outer != primitive) {
+		statsAdd(&statCounters[primitive].calls, 1);
+		statsAdd(&statCounters[primitive].limbs, limbs);
+	}
+	statPrimitive = primitive;
+	return outer;
+}
+
+/**
+ * Histogram bucket of a latency in nanoseconds. Up to 4 each value has its own, beyond that
+ * every power of two is split in 4, so no bucket is more than a quarter of its low end wide.
+ */
+int statsBucket(unsigned long long ns) {
+	int top;
+	if(ns < 4) return (int)ns;
+	top = 63 - __builtin_clzll(ns);
+	return 4 * (top - 1) + (int)((ns >> (top - 2)) & 3);
+}
+
+/**
+ * Largest latency in nanoseconds that goes in the given bucket.
+ */
+unsigned long long statsBucketLimit(int bucket) {
+	if(bucket < 4) return bucket;
+	return ((unsigned long long)(bucket % 4 + 5) << (bucket / 4 - 1)) - 1;
+}
+
+/**
+ * Add count blocks, just done on this thread, to a histogram. They were exponentiated
+ * together, so each is given an even share of the time since STATS_BLOCK_START.
+ */
+void statsBlocks(int histogram, int count) {
+	statHistogram* h = &statHistograms[histogram];
+	unsigned long long ns, max;
+	if(count <= 0) return;
+	ns = (unsigned long long)((wallSeconds() - statBlockStart) * 1e9 / count);
+	statsAdd(&h->counts[statsBucket(ns)], count);
+	statsAdd(&h->total, count);
+	max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	while(ns > max && !__atomic_compare_exchange_n(&h->max, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/**
+ * Add the wall time since STATS_PHASE_START to a phase. Phases are timed on one thread.
+ */
+void statsPhase(int phase) {
+	statPhases[phase] += wallSeconds() - statPhaseStart;
+}
+
+/**
+ * Latency in microseconds that the given fraction of a histogram's blocks stay within. This
+ * is the top of the bucket it falls in, so up to a quarter high, but never above the max.
+ */
+double statsPercentile(statHistogram* h, double fraction) {
+	unsigned long long seen = 0;
+	int i;
+	for(i = 0; i < STAT_BUCKETS - 1; i++) {
+		seen += h->counts[i];
+		if(seen >= fraction * h->total) break;
+	}
+	return MIN(statsBucketLimit(i), h->max) / 1e3;
+}
+
+/**
+ * Print the counters, the latency percentiles and the phase times to stderr, leaving out
+ * whatever never happened. Standard output is flushed first so the two do not interleave.
+ */
+void statsDump(void) {
+	statHistogram* h;
+	int i, printed = 0;
+	fflush(stdout);
+	fprintf(stderr, "\n%-14s %14s %16s %12s\n", "primitive", "calls", "limbs", "allocations");
+	for(i = 0; i < STAT_PRIMITIVES; i++) {
+		if(statCounters[i].calls == 0 && statCounters[i].allocations == 0) continue;
+		fprintf(stderr, "%-14s %14llu %16llu %12llu\n", STAT_NAMES[i], statCounters[i].calls,
+			statCounters[i].limbs, statCounters[i].allocations);
+	}
+	for(i = 0; i < STAT_HISTOGRAMS; i++) {
+		h = &statHistograms[i];
+		if(h->total == 0) continue;
+		if(i == 0 || statHistograms[0].total == 0) {
+			fprintf(stderr, "\n%-14s %10s %12s %12s %12s\n", "blocks", "count", "p50 us", "p99 us", "max us");
+		}
+		fprintf(stderr, "%-14s %10llu %12.1f %12.1f %12.1f\n", STAT_HISTOGRAM_NAMES[i], h->total,
+			statsPercentile(h, 0.5), statsPercentile(h, 0.99), h->max / 1e3);
+	}
+	for(i = 0; i < STAT_PHASES; i++) {
+		if(statPhases[i] <= 0) continue;
+		if(!printed++) fprintf(stderr, "\n%-14s %10s\n", "phase", "seconds");
+		fprintf(stderr, "%-14s %10.3f\n", STAT_PHASE_NAMES[i], statPhases[i]);
+	}
+}
+
+/**
+ * Have statsDump run at exit, whichever way the program gets there.
+ */
+__attribute__((constructor)) void statsInit(void) {
+	atexit(statsDump);
+}
+#endif
+
 /**
  * Initialize a bignum structure. This is the only way to safely create a bignum
  * and should be called where-ever one is declared. (We realloc the memory in all
@@ -82,6 +700,8 @@ bignum* bignum_init() {
 	b->length = 0;
 	b->capacity = BIGNUM_CAPACITY;
 	b->data = calloc(BIGNUM_CAPACITY, sizeof(word));
+	bignumAllocations += 2;
+	STATS_ALLOCATE(2);
 	return b;
 }
 
@@ -93,6 +713,58 @@ void bignum_deinit(bignum* b) {
 	free(b);
 }
 
+/**
+ * Make sure there is room for at least capacity words in b. This is the only place
+ * limb storage grows.
+ */
+void bignum_reserve(bignum* b, int capacity) {
+	if(capacity > b->capacity) {
+		b->capacity = capacity;
+		b->data = realloc(b->data, b->capacity * sizeof(word));
+		bignumAllocations++;
+		STATS_ALLOCATE(1);
+	}
+}
+
+/**
+ * Take a temporary bignum from the scratch stack. It has length zero, but keeps whatever
+ * storage it grew to when it was last used, so taking temporaries only allocates until the
+ * stack has warmed up to the depth and sizes an operation needs.
+ */
+bignum* bignum_push() {
+	int i;
+	if(SCRATCH.top == SCRATCH.capacity) {
+		SCRATCH.capacity = SCRATCH.capacity * 2 + 16;
+		SCRATCH.stack = realloc(SCRATCH.stack, SCRATCH.capacity * sizeof(bignum*));
+		bignumAllocations++;
+		STATS_ALLOCATE(1);
+		for(i = SCRATCH.top; i < SCRATCH.capacity; i++) SCRATCH.stack[i] = bignum_init();
+	}
+	SCRATCH.stack[SCRATCH.top]->length = 0;
+	return SCRATCH.stack[SCRATCH.top++];
+}
+
+/**
+ * Give back the count most recently taken temporaries. Temporaries must be given back in
+ * the reverse order they were taken, which holds as long as every function pops what it
+ * pushed before returning.
+ */
+void bignum_pop(int count) {
+	SCRATCH.top -= count;
+}
+
+/**
+ * Free the scratch stack of the calling thread. Threads other than the main one should
+ * call this before they exit.
+ */
+void bignum_scratch_free() {
+	int i;
+	for(i = 0; i < SCRATCH.capacity; i++) bignum_deinit(SCRATCH.stack[i]);
+	free(SCRATCH.stack);
+	SCRATCH.stack = NULL;
+	SCRATCH.top = SCRATCH.capacity = 0;
+}
+
 /**
  * Check if the given bignum is zero
  */
@@ -112,158 +784,342 @@ int bignum_isnonzero(bignum* b) {
  */
 void bignum_copy(bignum* source, bignum* dest) {
 	dest->length = source->length;
-	if(source->capacity > dest->capacity) {
-		dest->capacity = source->capacity;
-		dest->data = realloc(dest->data, dest->capacity * sizeof(word));
-	}
+	bignum_reserve(dest, source->length);
 	memcpy(dest->data, source->data, dest->length * sizeof(word));
 }
 
 /**
- * Load a bignum from a base 10 string. Only pure numeric strings will work.
+ * Power of ten for splitting decimal conversions, 10^(DECIMAL_DIGITS * 2^k). The powers
+ * are shared between threads and kept for the life of the program.
  */
-void bignum_fromstring(bignum* b, char* string) {
-	int i, len = 0;
-	while(string[len] != '\0') len++; /* Find string length */
-	for(i = 0; i < len; i++) {
-		if(i != 0) bignum_imultiply(b, &NUMS[10]); /* Base 10 multiply */
-		bignum_iadd(b, &NUMS[string[i] - '0']); /* Add */
+bignum* bignum_decimalpower(int k) {
+	bignum* power;
+	pthread_mutex_lock(&decimalLock);
+	while(decimalPowers <= k) {
+		DECIMAL_POWERS[decimalPowers] = bignum_init();
+		if(decimalPowers == 0) bignum_fromint(DECIMAL_POWERS[0], DECIMAL_BASE);
+		else bignum_square(DECIMAL_POWERS[decimalPowers], DECIMAL_POWERS[decimalPowers - 1]);
+		decimalPowers++;
 	}
+	power = DECIMAL_POWERS[k];
+	pthread_mutex_unlock(&decimalLock);
+	return power;
 }
 
 /**
- * Load a bignum from an unsigned integer.
+ * Multiply b by the single word mul and add the single word add, in place.
  */
-void bignum_fromint(bignum* b, unsigned int num) {
-	b->length = 1;
-	if(b->capacity < b->length) {
-		b->capacity = b->length;
-		b->data = realloc(b->data, b->capacity * sizeof(word));
+void bignum_imuladdword(bignum* b, word mul, word add) {
+	dword prod;
+	int i;
+	bignum_reserve(b, b->length + 1);
+	for(i = 0; i < b->length; i++) {
+		prod = (dword)b->data[i] * mul + add;
+		b->data[i] = (word)prod;
+		add = (word)(prod >> WORD_BITS);
 	}
-	b->data[0] = num;
+	if(add != 0) b->data[b->length++] = add;
 }
 
 /**
- * Print a bignum to stdout as base 10 integer. This is done by
- * repeated division by 10. We can make it more efficient by dividing by
- * 10^9 for example, then doing single precision arithmetic to retrieve the
- * 9 remainders
+ * Divide b by the single word div in place, returning the remainder.
  */
-void bignum_print(bignum* b) {
-	int cap = 100, len = 0, i;
-	char* buffer = malloc(cap * sizeof(char));
-	bignum *copy = bignum_init(), *remainder = bignum_init();
-	if(b->length == 0 || bignum_iszero(b)) printf("0");
-	else {
-		bignum_copy(b, copy);
-		while(bignum_isnonzero(copy)) {
-			bignum_idivider(copy, &NUMS[10], remainder);
-			buffer[len++] = remainder->data[0];
-			if(len >= cap) {
-				cap *= 2;
-				buffer = realloc(buffer, cap * sizeof(char));
-			}
-		}
-		for(i = len - 1; i >= 0; i--) printf("%d", buffer[i]);
+word bignum_idivword(bignum* b, word div) {
+	dword rem = 0;
+	int i;
+	for(i = b->length - 1; i >= 0; i--) {
+		rem = rem * RADIX + b->data[i];
+		b->data[i] = (word)(rem / div);
+		rem %= div;
 	}
-	bignum_deinit(copy);
-	bignum_deinit(remainder);
-	free(buffer);
+	while(b->length > 0 && b->data[b->length - 1] == 0) b->length--;
+	return (word)rem;
 }
 
 /**
- * Check if two bignums are equal.
+ * Read the base 10 string of the given length into b. Strings of up to DECIMAL_THRESHOLD
+ * chunks are read DECIMAL_DIGITS at a time with single word multiply-adds, longer ones are
+ * split so that the low part is DECIMAL_DIGITS * 2^k digits long and
+ * b = high * 10^(DECIMAL_DIGITS * 2^k) + low, letting the multiply do the heavy lifting.
  */
-int bignum_equal(bignum* b1, bignum* b2) {
-	int i;
-	if(bignum_iszero(b1) && bignum_iszero(b2)) return 1;
-	else if(bignum_iszero(b1)) return 0;
-	else if(bignum_iszero(b2)) return 0;
-	else if(b1->length != b2->length) return 0;
-	for(i = b1->length - 1; i >= 0; i--) {
-		if(b1->data[i] != b2->data[i]) return 0;
+void bignum_fromdecimal(bignum* b, char* string, int len) {
+	bignum *high, *low;
+	word chunk, scale;
+	int i, j, k;
+	if(len > DECIMAL_THRESHOLD * DECIMAL_DIGITS) {
+		high = bignum_push();
+		low = bignum_push();
+		for(k = 0; DECIMAL_DIGITS << (k + 1) < len; k++);
+		bignum_fromdecimal(high, string, len - (DECIMAL_DIGITS << k));
+		bignum_fromdecimal(low, string + len - (DECIMAL_DIGITS << k), DECIMAL_DIGITS << k);
+		bignum_multiply(b, high, bignum_decimalpower(k));
+		bignum_iadd(b, low);
+		bignum_pop(2);
+		return;
+	}
+	b->length = 0;
+	for(i = 0; i < len; i = j) {
+		/* The first chunk takes the odd digits so the rest are whole chunks */
+		j = i == 0 ? (len - 1) % DECIMAL_DIGITS + 1 : i + DECIMAL_DIGITS;
+		for(chunk = 0, scale = 1; i < j; i++, scale *= 10) chunk = chunk * 10 + (string[i] - '0');
+		bignum_imuladdword(b, scale, chunk);
 	}
-	return 1;
 }
 
 /**
- * Check if bignum b1 is greater than b2
+ * Load a bignum from a base 10 string. Only pure numeric strings will work.
  */
-int bignum_greater(bignum* b1, bignum* b2) {
-	int i;
-	if(bignum_iszero(b1) && bignum_iszero(b2)) return 0;
-	else if(bignum_iszero(b1)) return 0;
-	else if(bignum_iszero(b2)) return 1;
-	else if(b1->length != b2->length) return b1->length > b2->length;
-	for(i = b1->length - 1; i >= 0; i--) {
-		if(b1->data[i] != b2->data[i]) return b1->data[i] > b2->data[i];
-	}
-	return 0;
+void bignum_fromstring(bignum* b, char* string) {
+	bignum_fromdecimal(b, string, strlen(string));
 }
 
 /**
- * Check if bignum b1 is less than b2
+ * Upper bound on the number of decimal digits of b, rounded up to whole chunks of
+ * DECIMAL_DIGITS. The buffer for bignum_tostring needs one more than this for the terminator.
  */
-int bignum_less(bignum* b1, bignum* b2) {
+int bignum_decimalsize(bignum* b) {
+	return ((int)(bignum_bitlength(b) * 0.30103) / DECIMAL_DIGITS + 1) * DECIMAL_DIGITS;
+}
+
+/**
+ * Write the single word chunk as exactly DECIMAL_DIGITS digits, zero padded.
+ */
+void bignum_writechunk(word chunk, char* out) {
 	int i;
-	if(bignum_iszero(b1) && bignum_iszero(b2)) return 0;
-	else if(bignum_iszero(b1)) return 1;
-	else if(bignum_iszero(b2)) return 0;
-	else if(b1->length != b2->length) return b1->length < b2->length;
-	for(i = b1->length - 1; i >= 0; i--) {
-		if(b1->data[i] != b2->data[i]) return b1->data[i] < b2->data[i];
+	for(i = DECIMAL_DIGITS - 1; i >= 0; i--) {
+		out[i] = '0' + chunk % 10;
+		chunk /= 10;
 	}
-	return 0;
 }
 
 /**
- * Check if bignum b1 is greater than or equal to b2
+ * Write b, which must be below 10^(DECIMAL_DIGITS * chunks), as exactly
+ * DECIMAL_DIGITS * chunks digits with leading zeros. chunks is a power of two. b is
+ * destroyed.
  */
-int bignum_geq(bignum* b1, bignum* b2) {
-	return !bignum_less(b1, b2);
+void bignum_writedecimal(bignum* b, char* out, int chunks) {
+	bignum *q, *r;
+	int k;
+	if(b->length <= DECIMAL_THRESHOLD || chunks == 1) {
+		while(chunks-- > 0) bignum_writechunk(bignum_idivword(b, DECIMAL_BASE), out + chunks * DECIMAL_DIGITS);
+		return;
+	}
+	q = bignum_push();
+	r = bignum_push();
+	for(k = 0; 2 << k < chunks; k++);
+	bignum_divide(q, r, b, bignum_decimalpower(k));
+	bignum_writedecimal(q, out, chunks / 2);
+	bignum_writedecimal(r, out + (chunks / 2) * DECIMAL_DIGITS, chunks / 2);
+	bignum_pop(2);
 }
 
 /**
- * Check if bignum b1 is less than or equal to b2
+ * Write b in base 10 to buffer, with room for bignum_decimalsize(b) + 1 characters, and
+ * return the number of digits. Numbers of up to DECIMAL_THRESHOLD words are taken apart a
+ * chunk of DECIMAL_DIGITS at a time by single word division. Longer ones are divided by
+ * the largest cached power of ten 10^(DECIMAL_DIGITS * 2^k) below them, the quotient
+ * written the same way and the remainder as exactly DECIMAL_DIGITS * 2^k digits, which
+ * halves again around smaller powers.
  */
-int bignum_leq(bignum* b1, bignum* b2) {
-	return !bignum_greater(b1, b2);
+int bignum_tostring(bignum* b, char* buffer) {
+	bignum *copy = bignum_push(), *q, *r;
+	int k, len = 0, end;
+	bignum_copy(b, copy);
+	while(copy->length > 0 && copy->data[copy->length - 1] == 0) copy->length--;
+	if(copy->length > DECIMAL_THRESHOLD) {
+		q = bignum_push();
+		r = bignum_push();
+		for(k = 0; bignum_decimalpower(k + 1)->length <= copy->length && !bignum_less(copy, bignum_decimalpower(k + 1)); k++);
+		bignum_divide(q, r, copy, bignum_decimalpower(k));
+		len = bignum_tostring(q, buffer);
+		bignum_writedecimal(r, buffer + len, 1 << k);
+		len += DECIMAL_DIGITS << k;
+		buffer[len] = '\0';
+		bignum_pop(3);
+		return len;
+	}
+	/* Chunks go in padded from the end of the buffer, then the leading zeros are dropped */
+	end = bignum_decimalsize(copy);
+	for(len = end; copy->length > 0; len -= DECIMAL_DIGITS) {
+		bignum_writechunk(bignum_idivword(copy, DECIMAL_BASE), buffer + len - DECIMAL_DIGITS);
+	}
+	while(len < end - 1 && buffer[len] == '0') len++;
+	if(len == end) buffer[--len] = '0';
+	memmove(buffer, buffer + len, end - len);
+	buffer[end - len] = '\0';
+	bignum_pop(1);
+	return end - len;
 }
 
 /**
- * Perform an in place add into the source bignum. That is source += add
+ * Load a bignum from a single word unsigned integer.
+ */
+void bignum_fromint(bignum* b, word num) {
+	b->length = 1;
+	bignum_reserve(b, 1);
+	b->data[0] = num;
+}
+
+/**
+ * Load b from len bytes, packing the low "bits" bits of each least significant first,
+ * b = bytes[0] + bytes[1] * 2^bits + bytes[2] * 2^(2 * bits) + .. With 8 bits whole words
+ * are put together straight from the bytes, otherwise they are fed through a bit buffer.
+ */
+void bignum_frombytes(bignum* b, unsigned char* bytes, int len, int bits) {
+	int i, j, shift = 0, n = ((long)len * bits + WORD_BITS - 1) / WORD_BITS;
+	dword buffer = 0;
+	bignum_reserve(b, MAX(n, 1));
+	b->length = n;
+	if(bits == 8) {
+		for(i = 0; i < n; i++) {
+			b->data[i] = 0;
+			for(j = 0; j < (int)sizeof(word) && i * (int)sizeof(word) + j < len; j++) {
+				b->data[i] |= (word)bytes[i * sizeof(word) + j] << (8 * j);
+			}
+		}
+	}
+	else {
+		for(i = 0, j = 0; i < len; i++) {
+			buffer |= (dword)(bytes[i] & ((1 << bits) - 1)) << shift;
+			shift += bits;
+			if(shift >= WORD_BITS) {
+				b->data[j++] = (word)buffer;
+				buffer >>= WORD_BITS;
+				shift -= WORD_BITS;
+			}
+		}
+		if(shift > 0) b->data[j] = (word)buffer;
+	}
+	while(b->length > 0 && b->data[b->length - 1] == 0) b->length--;
+}
+
+/**
+ * Unpack b into len bytes of "bits" bits each, the inverse of bignum_frombytes. Bytes past
+ * the top of b are zero, bits of b past len * bits are dropped.
+ */
+void bignum_tobytes(bignum* b, unsigned char* bytes, int len, int bits) {
+	int i, j, shift = 0;
+	dword buffer = 0;
+	if(bits == 8) {
+		for(i = 0; i * (int)sizeof(word) < len; i++) {
+			word w = i < b->length ? b->data[i] : 0;
+			for(j = 0; j < (int)sizeof(word) && i * (int)sizeof(word) + j < len; j++) {
+				bytes[i * sizeof(word) + j] = (unsigned char)(w >> (8 * j));
+			}
+		}
+		return;
+	}
+	for(i = 0, j = 0; i < len; i++) {
+		if(shift < bits) {
+			buffer |= (dword)(j < b->length ? b->data[j] : 0) << shift;
+			j++;
+			shift += WORD_BITS;
+		}
+		bytes[i] = (unsigned char)(buffer & ((1 << bits) - 1));
+		buffer >>= bits;
+		shift -= bits;
+	}
+}
+
+/**
+ * Print a bignum to stdout as base 10 integer, see bignum_tostring.
+ */
+void bignum_print(bignum* b) {
+	char* buffer = malloc(bignum_decimalsize(b) + 1);
+	bignum_tostring(b, buffer);
+	fputs(buffer, stdout);
+	free(buffer);
+}
+
+/**
+ * Check if two bignums are equal.
+ */
+int bignum_equal(bignum* b1, bignum* b2) {
+	int i;
+	if(bignum_iszero(b1) && bignum_iszero(b2)) return 1;
+	else if(bignum_iszero(b1)) return 0;
+	else if(bignum_iszero(b2)) return 0;
+	else if(b1->length != b2->length) return 0;
+	for(i = b1->length - 1; i >= 0; i--) {
+		if(b1->data[i] != b2->data[i]) return 0;
+	}
+	return 1;
+}
+
+/**
+ * Check if bignum b1 is greater than b2
+ */
+int bignum_greater(bignum* b1, bignum* b2) {
+	int i;
+	if(bignum_iszero(b1) && bignum_iszero(b2)) return 0;
+	else if(bignum_iszero(b1)) return 0;
+	else if(bignum_iszero(b2)) return 1;
+	else if(b1->length != b2->length) return b1->length > b2->length;
+	for(i = b1->length - 1; i >= 0; i--) {
+		if(b1->data[i] != b2->data[i]) return b1->data[i] > b2->data[i];
+	}
+	return 0;
+}
+
+/**
+ * Check if bignum b1 is less than b2
+ */
+int bignum_less(bignum* b1, bignum* b2) {
+	int i;
+	if(bignum_iszero(b1) && bignum_iszero(b2)) return 0;
+	else if(bignum_iszero(b1)) return 1;
+	else if(bignum_iszero(b2)) return 0;
+	else if(b1->length != b2->length) return b1->length < b2->length;
+	for(i = b1->length - 1; i >= 0; i--) {
+		if(b1->data[i] != b2->data[i]) return b1->data[i] < b2->data[i];
+	}
+	return 0;
+}
+
+/**
+ * Check if bignum b1 is greater than or equal to b2
+ */
+int bignum_geq(bignum* b1, bignum* b2) {
+	return !bignum_less(b1, b2);
+}
+
+/**
+ * Check if bignum b1 is less than or equal to b2
+ */
+int bignum_leq(bignum* b1, bignum* b2) {
+	return !bignum_greater(b1, b2);
+}
+
+/**
+ * Perform an in place add into the source bignum. That is source += add
  */
 void bignum_iadd(bignum* source, bignum* add) {
-	bignum* temp = bignum_init();
+	bignum* temp = bignum_push();
 	bignum_add(temp, source, add);
 	bignum_copy(temp, source);
-	bignum_deinit(temp);
+	bignum_pop(1);
 }
 
 /**
  * Add two bignums by the add with carry method. result = b1 + b2
  */
 void bignum_add(bignum* result, bignum* b1, bignum* b2) {
+	STATS_ENTER(STAT_ADD, b1->length + b2->length)
 	word sum, carry = 0;
 	int i, n = MAX(b1->length, b2->length);
-	if(n + 1 > result->capacity) {
-		result->capacity = n + 1;
-		result->data = realloc(result->data, result->capacity * sizeof(word));
-	}
+	bignum_reserve(result, n + 1);
 	for(i = 0; i < n; i++) {
-		sum = carry;
-		if(i < b1->length) sum += b1->data[i];
-		if(i < b2->length) sum += b2->data[i];
-		result->data[i] = sum; /* Already taken mod 2^32 by unsigned wrap around */
-
+		sum = carry; /* Sums are taken mod RADIX by unsigned wrap around */
+		carry = 0;
 		if(i < b1->length) {
-			if(sum < b1->data[i]) carry = 1; /* Result must have wrapped 2^32 so carry bit is 1 */
-			else carry = 0;
+			sum += b1->data[i];
+			if(sum < b1->data[i]) carry = 1; /* Result must have wrapped RADIX so carry bit is 1 */
 		}
-		else {
-			if(sum < b2->data[i]) carry = 1; /* Result must have wrapped 2^32 so carry bit is 1 */
-			else carry = 0;
+		if(i < b2->length) {
+			sum += b2->data[i];
+			if(sum < b2->data[i]) carry = 1; /* Result must have wrapped RADIX so carry bit is 1 */
 		}
+		result->data[i] = sum;
 	}
 	if(carry == 1) {
 		result->length = n + 1;
@@ -272,16 +1128,17 @@ void bignum_add(bignum* result, bignum* b1, bignum* b2) {
 	else {
 		result->length = n;
 	}
+	STATS_LEAVE();
 }
 
 /**
  * Perform an in place subtract from the source bignum. That is, source -= sub
  */
 void bignum_isubtract(bignum* source, bignum* sub) {
-	bignum* temp = bignum_init();
+	bignum* temp = bignum_push();
 	bignum_subtract(temp, source, sub);
 	bignum_copy(temp, source);
-	bignum_deinit(temp);
+	bignum_pop(1);
 }
 
 /**
@@ -289,607 +1146,2926 @@ void bignum_isubtract(bignum* source, bignum* sub) {
  * This uses the basic subtract with carry method
  */
 void bignum_subtract(bignum* result, bignum* b1, bignum* b2) {
+	STATS_ENTER(STAT_SUBTRACT, b1->length + b2->length)
 	int length = 0, i;
 	word carry = 0, diff, temp;
-	if(b1->length > result->capacity) {
-		result->capacity = b1->length;
-		result->data = realloc(result->data, result->capacity * sizeof(word));
-	}
+	bignum_reserve(result, b1->length);
 	for(i = 0; i < b1->length; i++) {
 		temp = carry;
 		if(i < b2->length) temp = temp + b2->data[i]; /* Auto wrapped mod RADIX */
 		diff = b1->data[i] - temp;
 		if(temp > b1->data[i]) carry = 1;
-		else {
-			if( temp == 0 && b2->data[i] == 0xffffffff ){
-				carry = 1;
-			}else{
-				carry = 0;
-			}
-		}
+		else if(temp != 0) carry = 0;
+		/* Otherwise temp is zero, either from a zero word or from carry + (RADIX - 1) wrapping
+		 * around, and the borrow is unchanged */
 		result->data[i] = diff;
 		if(result->data[i] != 0) length = i + 1;
 	}
 	result->length = length;
+	STATS_LEAVE();
 }
 
 /**
  * Perform an in place multiplication into the source bignum. That is source *= mult
  */
 void bignum_imultiply(bignum* source, bignum* mult) {
-	bignum* temp = bignum_init();
+	bignum* temp = bignum_push();
 	bignum_multiply(temp, source, mult);
 	bignum_copy(temp, source);
-	bignum_deinit(temp);
+	bignum_pop(1);
 }
 
 /**
- * Multiply two bignums by the naive school method. result = b1 * b2. I have experimented
- * with FFT mult and Karatsuba but neither was looking to be  more efficient than the school
- * method for reasonable number of digits. There are some improvments to be made here,
- * especially for squaring which can cut out half of the operations.
+ * Multiply two bignums, result = b1 * b2. Small operands use the school method, larger
+ * ones Karatsuba or Toom-3 depending on karatsubaThreshold and toom3Threshold. Squares
+ * are passed on to bignum_square.
  */
 void bignum_multiply(bignum* result, bignum* b1, bignum* b2) {
-	int i, j, k;
-	word carry, temp;
-	unsigned long long int prod; /* Long for intermediate product... this is not portable and should probably be changed */
-	if(b1->length + b2->length > result->capacity) {
-		result->capacity = b1->length + b2->length;
-		result->data = realloc(result->data, result->capacity * sizeof(word));
+	STATS_ENTER(STAT_MULTIPLY, b1->length + b2->length)
+	int n = MIN(b1->length, b2->length);
+	if(b1 == b2) bignum_square(result, b1);
+	else if(n < karatsubaThreshold) bignum_schoolmultiply(result, b1, b2);
+	else if(n < toom3Threshold) bignum_karatsuba(result, b1, b2);
+	else bignum_toom3(result, b1, b2);
+	STATS_LEAVE();
+}
+
+/**
+ * Multiply two bignums by the naive school method. result = b1 * b2. This is the base
+ * case for the recursive methods, and the fastest for reasonable number of digits.
+ * Squaring should go through bignum_square which cuts out half of the operations.
+ * Long enough operands go to schoolKernel, short ones to bignum_portablemultiply.
+ */
+void bignum_schoolmultiply(bignum* result, bignum* b1, bignum* b2) {
+	int i;
+	if(bignum_iszero(b1) || bignum_iszero(b2)) {
+		result->length = 0;
+		return;
+	}
+	bignum_reserve(result, b1->length + b2->length);
+	if(MIN(b1->length, b2->length) < VECTOR_THRESHOLD) {
+		bignum_portablemultiply(result->data, b1->data, b1->length, b2->data, b2->length);
+	}
+	else schoolKernel(result->data, b1->data, b1->length, b2->data, b2->length);
+	/* Drop leading zero words. There is at most one */
+	for(i = b1->length + b2->length; i > 0 && result->data[i - 1] == 0; i--);
+	result->length = i;
+}
+
+/**
+ * School multiplication of word arrays, r = a * b with room for na + nb words. Each row
+ * a[i] * b is added in with its carry running along the row. This is the reference for
+ * the vector kernels.
+ */
+void bignum_portablemultiply(word* r, word* a, int na, word* b, int nb) {
+	int i, j;
+	word carry;
+	dword prod;
+	for(j = 0; j < nb; j++) r[j] = 0;
+	for(i = 0; i < na; i++) {
+		carry = 0;
+		for(j = 0; j < nb; j++) {
+			prod = (dword)a[i] * b[j] + r[i + j] + carry; /* Can not overflow */
+			r[i + j] = (word)prod;
+			carry = (word)(prod / RADIX);
+		}
+		r[i + nb] = carry;
+	}
+}
+
+#ifdef SIMD_X86
+/**
+ * Split the na words at a into n digits of the given number of bits (at most 52) at x.
+ * Digits past the end of a are zero.
+ */
+void bignum_todigits(word* a, int na, unsigned long long* x, int n, int bits) {
+	int i, j = 0, have = 0;
+	unsigned __int128 buffer = 0; /* Up to 52 bits on top of a word */
+	for(i = 0; i < n; i++) {
+		while(have < bits) {
+			buffer |= (unsigned __int128)(j < na ? a[j] : 0) << have;
+			j++;
+			have += WORD_BITS;
+		}
+		x[i] = (unsigned long long)buffer & (((unsigned long long)1 << bits) - 1);
+		buffer >>= bits;
+		have -= bits;
+	}
+}
+
+/**
+ * Carry the column sums of a vector kernel into na + nb words at r. Column c of lo and
+ * column c - 1 of hi have weight 2^(bits * c), and each sum is below 2^63.
+ */
+void bignum_fromcolumns(unsigned long long* lo, unsigned long long* hi, int columns, int bits, word* r, int nr) {
+	unsigned long long sum, carry = 0;
+	int i, j = 0, have = 0;
+	unsigned __int128 buffer = 0; /* Up to 52 bits on top of a word */
+	for(i = 0; i < columns && j < nr; i++) {
+		sum = lo[i] + (i > 0 ? hi[i - 1] : 0) + carry;
+		carry = sum >> bits;
+		buffer |= (unsigned __int128)(sum & (((unsigned long long)1 << bits) - 1)) << have;
+		for(have += bits; have >= WORD_BITS && j < nr; have -= WORD_BITS) {
+			r[j++] = (word)buffer;
+			buffer >>= WORD_BITS;
+		}
+	}
+	if(j < nr) r[j++] = (word)buffer;
+	while(j < nr) r[j++] = 0;
+}
+
+/**
+ * Define a vector school multiplication kernel on digits of the given number of bits.
+ * Both operands are split into digits, b with VECTOR_ROWS - 1 zero digits in front, so the
+ * products of VECTOR_ROWS rows of a that fall in the same columns can be summed in
+ * registers from shifted loads of b before the column sums are updated. The low and high
+ * halves of the products go to separate sums, lo and hi, which are carried into r at the
+ * end. "product" is a statement adding a[i + k] * y to l and h. Operands long enough for a
+ * sum to overflow go to the portable kernel.
+ */
+#define BIGNUM_VECMUL(name, isa, vec, lanes, mm, si, set1, bits, product) \
+__attribute__((target(isa))) \
+void name(word* r, word* a, int na, word* b, int nb) { \
+	bignum* storage; \
+	unsigned long long *x, *y, *lo, *hi; \
+	vec l, h, ai[VECTOR_ROWS], v; \
+	int n = (na * WORD_BITS + bits - 1) / bits, m = (nb * WORD_BITS + bits - 1) / bits; \
+	int i, j, k, rows = (n + VECTOR_ROWS - 1) / VECTOR_ROWS * VECTOR_ROWS; \
+	int span = (m + VECTOR_ROWS - 1 + lanes - 1) / lanes * lanes, columns = rows + span; \
+	if(MIN(n, m) >= 1 << (62 - bits)) { \
+		bignum_portablemultiply(r, a, na, b, nb); \
+		return; \
+	} \
+	storage = bignum_push(); \
+	bignum_reserve(storage, (rows + VECTOR_ROWS + span + 2 * columns) * (int)(sizeof(unsigned long long) / sizeof(word))); \
+	x = (unsigned long long*)storage->data; \
+	y = x + rows; \
+	lo = y + VECTOR_ROWS + span; \
+	hi = lo + columns; \
+	bignum_todigits(a, na, x, rows, bits); \
+	for(j = 0; j < VECTOR_ROWS - 1; j++) y[j] = 0; \
+	bignum_todigits(b, nb, y + VECTOR_ROWS - 1, span + 1, bits); \
+	for(j = 0; j < 2 * columns; j++) lo[j] = 0; \
+	y += VECTOR_ROWS - 1; \
+	for(i = 0; i < rows; i += VECTOR_ROWS) { \
+		for(k = 0; k < VECTOR_ROWS; k++) ai[k] = set1(x[i + k]); \
+		for(j = 0; j < span; j += lanes) { \
+			l = mm##_loadu_##si((vec*)(lo + i + j)); \
+			h = mm##_loadu_##si((vec*)(hi + i + j)); \
+			for(k = 0; k < VECTOR_ROWS; k++) { \
+				v = mm##_loadu_##si((vec*)(y + j - k)); \
+				product \
+			} \
+			mm##_storeu_##si((vec*)(lo + i + j), l); \
+			mm##_storeu_##si((vec*)(hi + i + j), h); \
+		} \
+	} \
+	bignum_fromcolumns(lo, hi, columns, bits, r, na + nb); \
+	bignum_pop(1); \
+}
+
+/* 32 bit digits, vpmuludq and the product split into 32 bit halves */
+BIGNUM_VECMUL(bignum_avx2multiply, "avx2", __m256i, 4, _mm256, si256, _mm256_set1_epi64x, 32,
+	v = _mm256_mul_epu32(ai[k], v);
+	l = _mm256_add_epi64(l, _mm256_and_si256(v, _mm256_set1_epi64x(0xffffffff)));
+	h = _mm256_add_epi64(h, _mm256_srli_epi64(v, 32));)
+
+/* 52 bit digits, the halves come straight from vpmadd52luq and vpmadd52huq */
+BIGNUM_VECMUL(bignum_ifmamultiply, "avx512f,avx512ifma", __m512i, 8, _mm512, si512, _mm512_set1_epi64, 52,
+	l = _mm512_madd52lo_epu64(l, ai[k], v);
+	h = _mm512_madd52hi_epu64(h, ai[k], v);)
+
+/**
+ * Pick schoolKernel for this processor before main runs, and move the Karatsuba and Toom-3
+ * thresholds up to match. Only thresholds left at their defaults are raised, one given with
+ * -DKARATSUBA_THRESHOLD and the like is kept as it is. With 64 bit words the scalar multiply
+ * already does as much per instruction as the AVX2 kernel, so that one is only used with
+ * 32 bit words.
+ */
+__attribute__((constructor)) void bignum_dispatch(void) {
+	int threshold = 0;
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512ifma")) {
+		schoolKernel = bignum_ifmamultiply;
+		threshold = IFMA_KARATSUBA_BITS / WORD_BITS;
+	}
+	else if(__builtin_cpu_supports("avx2") && WORD_BITS == 32) {
+		schoolKernel = bignum_avx2multiply;
+		threshold = AVX2_KARATSUBA_BITS / WORD_BITS;
+	}
+#ifdef KARATSUBA_THRESHOLD_DEFAULT
+	karatsubaThreshold = MAX(karatsubaThreshold, threshold);
+#endif
+#ifdef KARATSUBA_SQUARE_THRESHOLD_DEFAULT
+	karatsubaSquareThreshold = MAX(karatsubaSquareThreshold, threshold);
+#endif
+#ifdef TOOM3_THRESHOLD_DEFAULT
+	toom3Threshold = MAX(toom3Threshold, 2 * threshold);
+#endif
+#ifdef TOOM3_SQUARE_THRESHOLD_DEFAULT
+	toom3SquareThreshold = MAX(toom3SquareThreshold, 2 * threshold);
+#endif
+}
+#endif
+
+/**
+ * Perform an in place squaring of source. That is source *= source
+ */
+void bignum_isquare(bignum* source) {
+	bignum* temp = bignum_push();
+	bignum_square(temp, source);
+	bignum_copy(temp, source);
+	bignum_pop(1);
+}
+
+/**
+ * Square a bignum, result = b * b. Large operands use the Karatsuba or Toom-3 split, which
+ * recurse into squares of their own, depending on karatsubaSquareThreshold and
+ * toom3SquareThreshold.
+ */
+void bignum_square(bignum* result, bignum* b) {
+	STATS_ENTER(STAT_SQUARE, b->length)
+	if(b->length < karatsubaSquareThreshold) bignum_schoolsquare(result, b);
+	else if(b->length < toom3SquareThreshold) bignum_karatsuba(result, b, b);
+	else bignum_toom3(result, b, b);
+	STATS_LEAVE();
+}
+
+/**
+ * Square a bignum by the school method, result = b * b. Each cross product b[i] * b[j]
+ * with i < j appears twice in the square, so they are computed once, doubled with a
+ * shift, and then the diagonal products b[i] * b[i] are added in. This is roughly half
+ * the single precision multiplies of bignum_schoolmultiply(result, b, b).
+ */
+void bignum_schoolsquare(bignum* result, bignum* b) {
+	int i, j, n = b->length;
+	word carry, top;
+	dword prod;
+	if(n >= VECTOR_SQUARE_THRESHOLD && schoolKernel != bignum_portablemultiply) {
+		bignum_schoolmultiply(result, b, b); /* The vector kernel is still ahead here */
+		return;
 	}
-	for(i = 0; i < b1->length + b2->length; i++) result->data[i] = 0;
+	bignum_reserve(result, 2 * n);
+	for(i = 0; i < 2 * n; i++) result->data[i] = 0;
 	
-	for(i = 0; i < b1->length; i++) {
-		for(j = 0; j < b2->length; j++) {
-			prod = (b1->data[i] * (unsigned long long int)b2->data[j]) + (unsigned long long int)(result->data[i+j]); /* This should not overflow... */
+	for(i = 0; i < n; i++) {
+		carry = 0;
+		for(j = i + 1; j < n; j++) {
+			prod = b->data[i] * (dword)b->data[j] + result->data[i+j] + carry; /* Can not overflow */
+			result->data[i+j] = (word)prod;
 			carry = (word)(prod / RADIX);
-			
-			/* Add carry to the next word over, but this may cause further overflow.. propogate */
-			k = 1;
-			while(carry > 0) {
-				temp = result->data[i+j+k] + carry;
-				if(temp < result->data[i+j+k]) carry = 1;
-				else carry = 0;
-				result->data[i+j+k] = temp; /* Already wrapped in unsigned arithmetic */
-				k++;
-			}
-			
-			prod = (result->data[i+j] + b1->data[i] * (unsigned long long int)b2->data[j]) % RADIX; /* Again, should not overflow... */
-			result->data[i+j] = prod; /* Add */
 		}
+		result->data[i+n] = carry;
+	}
+	/* Double the cross products */
+	carry = 0;
+	for(i = 0; i < 2 * n; i++) {
+		top = result->data[i] >> (WORD_BITS - 1);
+		result->data[i] = (result->data[i] << 1) | carry;
+		carry = top;
+	}
+	/* Add the diagonal */
+	carry = 0;
+	for(i = 0; i < n; i++) {
+		prod = b->data[i] * (dword)b->data[i] + result->data[2*i] + carry;
+		result->data[2*i] = (word)prod;
+		prod = (prod / RADIX) + result->data[2*i+1];
+		result->data[2*i+1] = (word)prod;
+		carry = (word)(prod / RADIX);
+	}
+	if(n > 0 && result->data[2 * n - 1] == 0) result->length = 2 * n - 1;
+	else result->length = 2 * n;
+}
+
+/**
+ * Make view a read only bignum for the words [start, start + length) of b, without copying.
+ * Leading zero words are dropped from the view. Views must never be written to or freed.
+ */
+void bignum_view(bignum* b, int start, int length, bignum* view) {
+	if(start > b->length) start = b->length;
+	if(start + length > b->length) length = b->length - start;
+	while(length > 0 && b->data[start + length - 1] == 0) length--;
+	view->length = length;
+	view->capacity = length;
+	view->data = b->data + start;
+}
+
+/**
+ * Add into source at a word offset. That is, source += add * RADIX^offset
+ */
+void bignum_iaddwords(bignum* source, bignum* add, int offset) {
+	int i, n = MAX(source->length, add->length + offset) + 1;
+	word sum, carry = 0;
+	bignum_reserve(source, n);
+	for(i = source->length; i < n; i++) source->data[i] = 0;
+	for(i = 0; i < add->length || carry > 0; i++) {
+		sum = source->data[offset + i] + carry;
+		carry = sum < carry;
+		if(i < add->length) {
+			sum += add->data[i];
+			carry += sum < add->data[i];
+		}
+		source->data[offset + i] = sum;
+	}
+	while(n > 0 && source->data[n - 1] == 0) n--;
+	source->length = n;
+}
+
+/**
+ * Signed addition for the Toom-3 interpolation, where intermediate values can go negative.
+ * Magnitudes are bignums and signs are +1 or -1. result = b1 + b2, and the sign of the
+ * result is returned. result may be the same bignum as b1.
+ */
+int bignum_signedadd(bignum* result, bignum* b1, int sign1, bignum* b2, int sign2) {
+	if(sign1 == sign2) {
+		bignum_add(result, b1, b2);
+		return sign1;
+	}
+	if(bignum_geq(b1, b2)) {
+		bignum_subtract(result, b1, b2);
+		return sign1;
+	}
+	bignum_subtract(result, b2, b1);
+	return sign2;
+}
+
+/**
+ * Multiply two bignums by Karatsuba's method. Splitting each operand in half at h words,
+ * b1 = x1 * RADIX^h + x0 and b2 = y1 * RADIX^h + y0, the product only needs the three
+ * half size products x0 * y0, x1 * y1 and (x0 + x1) * (y0 + y1). If b2 is too short to be
+ * split, b1 is multiplied by it in two halves instead.
+ */
+void bignum_karatsuba(bignum* result, bignum* b1, bignum* b2) {
+	bignum x0, x1, y0, y1, *temp;
+	bignum *z0 = bignum_push(), *z1 = bignum_push(), *z2 = bignum_push();
+	bignum *s1 = bignum_push(), *s2 = bignum_push();
+	int h;
+	if(b1->length < b2->length) {
+		temp = b1; b1 = b2; b2 = temp;
+	}
+	h = (b1->length + 1) / 2;
+	bignum_view(b1, 0, h, &x0);
+	bignum_view(b1, h, b1->length - h, &x1);
+	if(b2->length <= h) {
+		bignum_multiply(z0, &x0, b2);
+		bignum_multiply(z2, &x1, b2);
+		bignum_copy(z0, result);
+		bignum_iaddwords(result, z2, h);
+	}
+	else {
+		bignum_view(b2, 0, h, &y0);
+		bignum_view(b2, h, b2->length - h, &y1);
+		if(b1 == b2) { /* Squaring, keep the sub products as squares too */
+			bignum_square(z0, &x0);
+			bignum_square(z2, &x1);
+			bignum_add(s1, &x0, &x1);
+			bignum_square(z1, s1);
+		}
+		else {
+			bignum_multiply(z0, &x0, &y0);
+			bignum_multiply(z2, &x1, &y1);
+			bignum_add(s1, &x0, &x1);
+			bignum_add(s2, &y0, &y1);
+			bignum_multiply(z1, s1, s2);
+		}
+		bignum_subtract(z1, z1, z0); /* z1 = x0 * y1 + x1 * y0 */
+		bignum_subtract(z1, z1, z2);
+		bignum_copy(z0, result);
+		bignum_iaddwords(result, z1, h);
+		bignum_iaddwords(result, z2, 2 * h);
+	}
+	bignum_pop(5);
+}
+
+/**
+ * Evaluate the Toom-3 polynomial m2 * x^2 + m1 * x + m0 at x = 1, -1 and 2. The value at
+ * -1 can be negative so its sign is returned.
+ */
+int bignum_toom3evaluate(bignum* m0, bignum* m1, bignum* m2, bignum* p1, bignum* pm1, bignum* p2) {
+	int sign;
+	bignum_add(p1, m0, m2);
+	sign = bignum_signedadd(pm1, p1, 1, m1, -1); /* p(-1) = m0 + m2 - m1 */
+	bignum_iadd(p1, m1); /* p(1) = m0 + m1 + m2 */
+	bignum_add(p2, m2, m2);
+	bignum_iadd(p2, m1);
+	bignum_iadd(p2, p2);
+	bignum_iadd(p2, m0); /* p(2) = m0 + 2 * m1 + 4 * m2 */
+	return sign;
+}
+
+/**
+ * Multiply two bignums by Toom-3 (Toom-Cook with three way splits). Each operand is split
+ * into thirds of k words, read as a quadratic polynomial in RADIX^k. The product polynomial
+ * is found from five products of the evaluations at 0, 1, -1, 2 and infinity, and then
+ * interpolated using only exact divisions by 2 and 3. Operands that are too unbalanced to
+ * split into thirds use Karatsuba instead.
+ */
+void bignum_toom3(bignum* result, bignum* b1, bignum* b2) {
+	bignum x0, x1, x2, y0, y1, y2, *temp;
+	bignum *r0 = bignum_push(), *r1 = bignum_push(), *rm1 = bignum_push();
+	bignum *r2 = bignum_push(), *rinf = bignum_push();
+	bignum *p1 = bignum_push(), *pm1 = bignum_push(), *p2 = bignum_push();
+	bignum *q1 = bignum_push(), *qm1 = bignum_push(), *q2 = bignum_push();
+	int k, signm1;
+	if(b1->length < b2->length) {
+		temp = b1; b1 = b2; b2 = temp;
+	}
+	k = (b1->length + 2) / 3;
+	if(b2->length <= 2 * k) {
+		bignum_karatsuba(result, b1, b2);
+	}
+	else {
+		bignum_view(b1, 0, k, &x0);
+		bignum_view(b1, k, k, &x1);
+		bignum_view(b1, 2 * k, b1->length - 2 * k, &x2);
+		bignum_view(b2, 0, k, &y0);
+		bignum_view(b2, k, k, &y1);
+		bignum_view(b2, 2 * k, b2->length - 2 * k, &y2);
+		
+		/* Pointwise products. When squaring b1 == b2 and these all become squares */
+		signm1 = bignum_toom3evaluate(&x0, &x1, &x2, p1, pm1, p2);
+		if(b1 == b2) {
+			bignum_square(r0, &x0);
+			bignum_square(r1, p1);
+			bignum_square(rm1, pm1);
+			bignum_square(r2, p2);
+			bignum_square(rinf, &x2);
+			signm1 = 1;
+		}
+		else {
+			signm1 *= bignum_toom3evaluate(&y0, &y1, &y2, q1, qm1, q2);
+			bignum_multiply(r0, &x0, &y0);
+			bignum_multiply(r1, p1, q1);
+			bignum_multiply(rm1, pm1, qm1);
+			bignum_multiply(r2, p2, q2);
+			bignum_multiply(rinf, &x2, &y2);
+		}
+		
+		/* Interpolate, in the order GMP uses for these points. Only the first two steps can
+		 * see a negative value. Afterwards r(-1), r(1) and r(2) hold the x, x^2 and x^3
+		 * coefficients. */
+		bignum_signedadd(r2, r2, 1, rm1, -signm1);
+		bignum_idivide(r2, &NUMS[3]); /* (r(2) - r(-1)) / 3 */
+		bignum_signedadd(rm1, r1, 1, rm1, -signm1);
+		bignum_irshift(rm1, 1); /* (r(1) - r(-1)) / 2 */
+		bignum_subtract(r1, r1, r0);
+		bignum_subtract(r2, r2, r1);
+		bignum_irshift(r2, 1);
+		bignum_subtract(r1, r1, rm1);
+		bignum_subtract(r1, r1, rinf);
+		bignum_subtract(r2, r2, rinf);
+		bignum_subtract(r2, r2, rinf);
+		bignum_subtract(rm1, rm1, r2);
+		
+		bignum_copy(r0, result);
+		bignum_iaddwords(result, rm1, k);
+		bignum_iaddwords(result, r1, 2 * k);
+		bignum_iaddwords(result, r2, 3 * k);
+		bignum_iaddwords(result, rinf, 4 * k);
 	}
-	if(b1->length + b2->length > 0 && result->data[b1->length + b2->length - 1] == 0) result->length = b1->length + b2->length - 1;
-	else result->length = b1->length + b2->length;
+	bignum_pop(11);
 }
 
 /**
  * Perform an in place divide of source. source = source/div.
  */
 void bignum_idivide(bignum *source, bignum *div) {
-	bignum *q = bignum_init(), *r = bignum_init();
+	bignum *q = bignum_push(), *r = bignum_push();
 	bignum_divide(q, r, source, div);
 	bignum_copy(q, source);
-	bignum_deinit(q);
-	bignum_deinit(r);
+	bignum_pop(2);
+}
+
+/**
+ * Perform an in place divide of source, also producing a remainder.
+ * source = source/div and remainder = source - source/div.
+ */
+void bignum_idivider(bignum* source, bignum* div, bignum* remainder) {
+	bignum *q = bignum_push(), *r = bignum_push();
+	bignum_divide(q, r, source, div);
+	bignum_copy(q, source);
+	bignum_copy(r, remainder);
+	bignum_pop(2);
+}
+
+/**
+ * Calculate the remainder when source is divided by div.
+ */
+void bignum_remainder(bignum* source, bignum *div, bignum* remainder) {
+	bignum *q = bignum_push();
+	bignum_divide(q, remainder, source, div);
+	bignum_pop(1);
+}
+
+/**
+ * Calculate the remainder when b is divided by the single word div, without touching b.
+ */
+word bignum_modword(bignum* b, word div) {
+	dword rem = 0;
+	int i;
+	for(i = b->length - 1; i >= 0; i--) rem = (rem * RADIX + b->data[i]) % div;
+	return (word)rem;
+}
+
+/**
+ * Bit i of b, counting from the least significant bit.
+ */
+int bignum_testbit(bignum* b, int i) {
+	if(i / WORD_BITS >= b->length) return 0;
+	return (b->data[i / WORD_BITS] >> (i % WORD_BITS)) & 1;
+}
+
+/**
+ * Number of bits in b, so that 2^(bitlength - 1) <= b < 2^bitlength. Zero has no bits.
+ */
+int bignum_bitlength(bignum* b) {
+	int i = b->length - 1, bits = 0;
+	word w;
+	while(i >= 0 && b->data[i] == 0) i--;
+	if(i < 0) return 0;
+	for(w = b->data[i]; w != 0; w >>= 1) bits++;
+	return i * WORD_BITS + bits;
+}
+
+/**
+ * Count the trailing zero bits of b, which should be nonzero.
+ */
+int bignum_ctz(bignum* b) {
+	int i = 0, bits = 0;
+	word w;
+	while(b->data[i] == 0) i++;
+	for(w = b->data[i]; (w & 1) == 0; w >>= 1) bits++;
+	return i * WORD_BITS + bits;
+}
+
+/**
+ * Shift b right in place by the given number of bits, b = b / 2^bits
+ */
+void bignum_irshift(bignum* b, int bits) {
+	int i, words = bits / WORD_BITS, length = 0;
+	bits %= WORD_BITS;
+	for(i = 0; i + words < b->length; i++) {
+		b->data[i] = b->data[i + words] >> bits;
+		/* Shifting a word by WORD_BITS is undefined, so bits == 0 takes nothing from above */
+		if(bits > 0 && i + words + 1 < b->length) b->data[i] |= b->data[i + words + 1] << (WORD_BITS - bits);
+		if(b->data[i] != 0) length = i + 1;
+	}
+	b->length = length;
+}
+
+/**
+ * Shift b left in place by the given number of bits, b = b * 2^bits
+ */
+void bignum_ilshift(bignum* b, int bits) {
+	int i, words = bits / WORD_BITS;
+	if(b->length == 0) return;
+	bits %= WORD_BITS;
+	bignum_reserve(b, b->length + words + 1);
+	b->data[b->length + words] = 0;
+	for(i = b->length - 1; i >= 0; i--) {
+		/* Shifting a word by WORD_BITS is undefined, so bits == 0 moves nothing up */
+		if(bits > 0) b->data[i + words + 1] |= b->data[i] >> (WORD_BITS - bits);
+		b->data[i + words] = b->data[i] << bits;
+	}
+	for(i = 0; i < words; i++) b->data[i] = 0;
+	b->length += words;
+	if(b->data[b->length] != 0) b->length++;
+}
+
+/**
+ * Modulate the source by the modulus. source = source % modulus
+ */
+void bignum_imodulate(bignum* source, bignum* modulus) {
+	bignum *q = bignum_push(), *r = bignum_push();
+	bignum_divide(q, r, source, modulus);
+	bignum_copy(r, source);
+	bignum_pop(2);
+}
+
+/**
+ * Divide two bignums by naive long division, producing both a quotient and remainder.
+ * quotient = floor(b1/b2), remainder = b1 - quotient * b2. If b1 < b2 the quotient is
+ * trivially 0 and remainder is b2. 
+ */
+void bignum_divide(bignum* quotient, bignum* remainder, bignum* b1, bignum* b2) {
+	STATS_ENTER(STAT_DIVIDE, b1->length + b2->length)
+	bignum *b2copy = bignum_push(), *b1copy = bignum_push();
+	bignum *temp2 = bignum_push(), *temp3 = bignum_push();
+	bignum* quottemp = bignum_push();
+	word carry = 0;
+	int n, m, i, j, length = 0, shift = 0;
+	dword gquot, gtemp, grem;
+	if(bignum_less(b1, b2)) { /* Trivial case, b1/b2 = 0 iff b1 < b2. */
+		quotient->length = 0;
+		bignum_copy(b1, remainder);
+	}
+	else if(bignum_iszero(b1)) { /* 0/x = 0.. assuming b2 is nonzero */
+		quotient->length = 0;
+		bignum_fromint(remainder, 0);
+	}
+	else if(b2->length == 1) { /* Division by a single limb means we can do simple division */
+		bignum_reserve(quotient, b1->length);
+		for(i = b1->length - 1; i >= 0; i--) {
+			gtemp = carry * RADIX + b1->data[i];
+			gquot = gtemp / b2->data[0];
+			quotient->data[i] = gquot;
+			if(quotient->data[i] != 0 && length == 0) length = i + 1;
+			carry = gtemp % b2->data[0];
+		}
+		bignum_fromint(remainder, carry);
+		quotient->length = length;
+	}
+	else { /* Long division is neccessary */
+		n = b1->length + 1;
+		m = b2->length;
+		bignum_reserve(quotient, n - m);
+		bignum_copy(b1, b1copy);
+		bignum_copy(b2, b2copy);
+		/* Normalize.. shift the divisor left until MSB >= HALFRADIX. This ensures fast
+		 * convergence when guessing the quotient below. We also shift the dividend by the
+		 * same amount to ensure the result does not change. */
+		while((b2copy->data[b2copy->length - 1] << shift) < HALFRADIX) shift++;
+		bignum_ilshift(b2copy, shift);
+		bignum_ilshift(b1copy, shift);
+		/* Ensure the dividend is longer than the original (pre-normalized) divisor. If it is not
+		 * we introduce a dummy zero word to artificially inflate it. */
+		if(b1copy->length != n) {
+			b1copy->length++;
+			bignum_reserve(b1copy, b1copy->length);
+			b1copy->data[n - 1] = 0;
+		}
+		
+		/* Process quotient by long division */
+		for(i = n - m - 1; i >= 0; i--) {
+			gtemp = RADIX * b1copy->data[i + m] + b1copy->data[i + m - 1];
+			gquot = gtemp / b2copy->data[m - 1];
+			grem = gtemp % b2copy->data[m - 1];
+			/* Bring the guess down below RADIX, and to at most one more than the true quotient
+			 * word. The remainder has to follow the guess so it can not simply be capped. */
+			while(grem < RADIX && (gquot >= RADIX || gquot * b2copy->data[m - 2] > RADIX * grem + b1copy->data[i + m - 2])) {
+				gquot--;
+				grem += b2copy->data[m - 1];
+			}
+			quottemp->data[0] = gquot % RADIX;
+			quottemp->data[1] = (gquot / RADIX);
+			if(quottemp->data[1] != 0) quottemp->length = 2;
+			else quottemp->length = 1;
+			bignum_multiply(temp2, b2copy, quottemp);
+			bignum_reserve(temp3, m + 1);
+			temp3->length = 0;
+			for(j = 0; j <= m; j++) {
+				temp3->data[j] = b1copy->data[i + j];
+				if(temp3->data[j] != 0) temp3->length = j + 1;
+			}
+			if(bignum_less(temp3, temp2)) {
+				bignum_iadd(temp3, b2copy);
+				gquot--;
+			}
+			bignum_isubtract(temp3, temp2);
+			for(j = 0; j < temp3->length; j++) b1copy->data[i + j] = temp3->data[j];
+			for(j = temp3->length; j <= m; j++) b1copy->data[i + j] = 0;
+			quotient->data[i] = gquot;
+			if(quotient->data[i] != 0) quotient->length = i;
+		}
+		
+		if(quotient->data[b1->length - b2->length] == 0) quotient->length = b1->length - b2->length;
+		else quotient->length = b1->length - b2->length + 1;
+		
+		/* Shift back now to find final remainder */
+		bignum_irshift(b1copy, shift);
+		bignum_copy(b1copy, remainder);
+	}
+	bignum_pop(5);
+	STATS_LEAVE();
+}
+
+/**
+ * Set up a Montgomery context for the given odd modulus. Computing R^2 mod modulus here
+ * is the only division done by the Montgomery routines.
+ */
+bignum_mont* bignum_mont_init(bignum* modulus) {
+	bignum_mont* mont = malloc(sizeof(bignum_mont));
+	int i, n = modulus->length;
+	word inv = 1;
+	mont->modulus = bignum_init();
+	mont->r2 = bignum_init();
+	bignum_copy(modulus, mont->modulus);
+	/* Newton iteration for modulus^-1 mod RADIX, each step doubles the number of correct bits */
+	for(i = 1; i < WORD_BITS; i *= 2) inv *= 2 - modulus->data[0] * inv;
+	mont->minv = -inv;
+	bignum_reserve(mont->r2, 2 * n + 1);
+	for(i = 0; i < 2 * n; i++) mont->r2->data[i] = 0;
+	mont->r2->data[2 * n] = 1;
+	mont->r2->length = 2 * n + 1;
+	bignum_imodulate(mont->r2, modulus);
+	mont->fixedpow = fixedWidth ? bignum_fixedpow(n) : NULL;
+	return mont;
+}
+
+/**
+ * Free resources used by a Montgomery context.
+ */
+void bignum_mont_deinit(bignum_mont* mont) {
+	bignum_deinit(mont->modulus);
+	bignum_deinit(mont->r2);
+	free(mont);
+}
+
+/**
+ * Montgomery reduction, result = t * R^-1 mod modulus, for t < modulus * R. Each step adds
+ * a multiple of the modulus that clears the lowest remaining word of t, so after n steps
+ * the upper half of t holds the result (plus possibly one modulus). t is destroyed.
+ */
+void bignum_mont_redc(bignum_mont* mont, bignum* t, bignum* result) {
+	word *m = mont->modulus->data, *data;
+	word u, carry;
+	int i, j, n = mont->modulus->length, length = 0;
+	dword prod;
+	bignum_reserve(t, 2 * n + 1);
+	for(i = t->length; i <= 2 * n; i++) t->data[i] = 0;
+	data = t->data;
+	for(i = 0; i < n; i++) {
+		u = data[i] * mont->minv; /* Wraps mod RADIX */
+		carry = 0;
+		for(j = 0; j < n; j++) {
+			prod = u * (dword)m[j] + data[i + j] + carry; /* Can not overflow */
+			data[i + j] = (word)prod;
+			carry = (word)(prod / RADIX);
+		}
+		for(j = i + n; carry > 0; j++) {
+			data[j] += carry;
+			carry = data[j] < carry;
+		}
+	}
+	/* The upper half is now less than 2 * modulus, subtract the modulus once if needed */
+	data += n;
+	i = n - 1;
+	if(data[n] == 0) while(i >= 0 && data[i] == m[i]) i--;
+	if(data[n] != 0 || i < 0 || data[i] > m[i]) {
+		carry = 0;
+		for(j = 0; j < n; j++) {
+			prod = (dword)data[j] - m[j] - carry; /* Wraps on borrow */
+			data[j] = (word)prod;
+			carry = prod >= RADIX;
+		}
+		data[n] -= carry;
+	}
+	bignum_reserve(result, n + 1);
+	for(i = 0; i <= n; i++) {
+		result->data[i] = data[i];
+		if(data[i] != 0) length = i + 1;
+	}
+	result->length = length;
+}
+
+/**
+ * Montgomery multiplication, result = b1 * b2 * R^-1 mod modulus. The operands should be
+ * reduced modulo the modulus. result may be the same bignum as either operand.
+ */
+void bignum_mont_multiply(bignum_mont* mont, bignum* result, bignum* b1, bignum* b2) {
+	bignum* product = bignum_push();
+	bignum_multiply(product, b1, b2);
+	bignum_mont_redc(mont, product, result);
+	bignum_pop(1);
+}
+
+/**
+ * Montgomery squaring, result = b * b * R^-1 mod modulus. result may be the same bignum as b.
+ */
+void bignum_mont_square(bignum_mont* mont, bignum* result, bignum* b) {
+	bignum* product = bignum_push();
+	bignum_square(product, b);
+	bignum_mont_redc(mont, product, result);
+	bignum_pop(1);
+}
+
+/**
+ * Convert source, which should be less than the modulus, into the Montgomery domain.
+ */
+void bignum_mont_to(bignum_mont* mont, bignum* source, bignum* result) {
+	bignum_mont_multiply(mont, result, source, mont->r2);
+}
+
+/**
+ * Convert source out of the Montgomery domain.
+ */
+void bignum_mont_from(bignum_mont* mont, bignum* source, bignum* result) {
+	bignum* product = bignum_push();
+	bignum_copy(source, product);
+	bignum_mont_redc(mont, product, result);
+	bignum_pop(1);
+}
+
+/**
+ * Choose the sliding window width for an exponent of the given number of bits. Wider
+ * windows save multiplies but the table of odd powers costs 2^(k-1) multiplies to build,
+ * so they only pay off for long exponents.
+ */
+int bignum_windowsize(int bits) {
+	if(bits > 671) return WINDOW_MAX;
+	if(bits > 239) return 5;
+	if(bits > 79) return 4;
+	if(bits > 23) return 3;
+	return 1;
+}
+
+/**
+ * Find the next sliding window of the exponent, starting at bit i. A zero bit is a window
+ * of its own with value 0, otherwise this is the longest run of at most k bits that ends in
+ * a one, and the (odd) value of those bits is returned. length is set to the number of bits.
+ */
+int bignum_window(bignum* exponent, int i, int k, int* length) {
+	int j, l, value = 0;
+	if(!bignum_testbit(exponent, i)) {
+		*length = 1;
+		return 0;
+	}
+	l = MAX(i - k + 1, 0);
+	while(!bignum_testbit(exponent, l)) l++;
+	for(j = i; j >= l; j--) value = (value << 1) | bignum_testbit(exponent, j);
+	*length = i - l + 1;
+	return value;
+}
+
+/**
+ * Perform modular exponentiation in the Montgomery domain using a sliding window over the
+ * exponent. A table of the odd powers base^1, base^3, .., base^(2^k - 1) is precomputed,
+ * after which each window of up to k bits costs one multiply on top of the squarings.
+ * result = base^exponent mod modulus
+ */
+void bignum_mont_modpow(bignum_mont* mont, bignum* base, bignum* exponent, bignum* result) {
+	STATS_ENTER(STAT_MODPOW, base->length + exponent->length + mont->modulus->length)
+	bignum *x = bignum_push(), *square = bignum_push();
+	bignum* table[1 << (WINDOW_MAX - 1)];
+	int i = bignum_bitlength(exponent) - 1, j, k, length, value, started = 0, size;
+	if(mont->fixedpow != NULL) {
+		mont->fixedpow(mont, base, exponent, result);
+		STATS_LEAVE();
+		return;
+	}
+	k = bignum_windowsize(i + 1);
+	size = 1 << (k - 1);
+	for(j = 0; j < size; j++) table[j] = bignum_push();
+	if(bignum_geq(base, mont->modulus)) {
+		bignum_remainder(base, mont->modulus, table[0]);
+		bignum_mont_to(mont, table[0], table[0]);
+	}
+	else bignum_mont_to(mont, base, table[0]);
+	if(size > 1) bignum_mont_square(mont, square, table[0]);
+	for(j = 1; j < size; j++) bignum_mont_multiply(mont, table[j], table[j - 1], square);
+	
+	bignum_mont_to(mont, &NUMS[1], x);
+	while(i >= 0) {
+		value = bignum_window(exponent, i, k, &length);
+		if(started) for(j = 0; j < length; j++) bignum_mont_square(mont, x, x);
+		if(value != 0) {
+			if(started) bignum_mont_multiply(mont, x, x, table[value >> 1]);
+			else bignum_copy(table[value >> 1], x);
+			started = 1;
+		}
+		i -= length;
+	}
+	bignum_mont_from(mont, x, result);
+	bignum_pop(size + 2);
+	STATS_LEAVE();
+}
+
+/**
+ * Montgomery reduction of the 2n + 1 word t (top word zero) into n words,
+ * r = t * R^-1 mod m, as in bignum_mont_redc. t is destroyed.
+ */
+ALWAYS_INLINE void bignum_fixedredc(word* r, word* t, word* m, word minv, int n) {
+	word u, carry;
+	int i, j;
+	dword prod;
+	for(i = 0; i < n; i++) {
+		u = t[i] * minv; /* Wraps mod RADIX */
+		carry = 0;
+		UNROLL
+		for(j = 0; j < n; j++) {
+			prod = u * (dword)m[j] + t[i + j] + carry; /* Can not overflow */
+			t[i + j] = (word)prod;
+			carry = (word)(prod >> WORD_BITS);
+		}
+		/* Words above i + n are at most one short of overflowing, so the carry stops soon */
+		for(j = i + n; carry > 0; j++) {
+			t[j] += carry;
+			carry = t[j] < carry;
+		}
+	}
+	/* The upper half is now less than 2 * m, subtract m once if needed */
+	t += n;
+	i = n - 1;
+	if(t[n] == 0) while(i >= 0 && t[i] == m[i]) i--;
+	if(t[n] != 0 || i < 0 || t[i] > m[i]) {
+		carry = 0;
+		for(j = 0; j < n; j++) {
+			prod = (dword)t[j] - m[j] - carry; /* Wraps on borrow */
+			r[j] = (word)prod;
+			carry = (word)(prod >> WORD_BITS) & 1;
+		}
+	}
+	else for(j = 0; j < n; j++) r[j] = t[j];
+}
+
+/**
+ * Montgomery multiplication of n word operands, r = a * b * R^-1 mod m, with t of
+ * 2n + 1 words for the product. The operands are zero padded to exactly n words and
+ * reduced modulo m. r may be the same array as a or b.
+ */
+ALWAYS_INLINE void bignum_fixedmultiply(word* r, word* a, word* b, word* m, word minv, int n, word* t) {
+	word carry;
+	int i, j;
+	dword prod;
+	for(j = 0; j < n; j++) t[j] = 0;
+	for(i = 0; i < n; i++) {
+		carry = 0;
+		UNROLL
+		for(j = 0; j < n; j++) {
+			prod = (dword)a[j] * b[i] + t[i + j] + carry; /* Can not overflow */
+			t[i + j] = (word)prod;
+			carry = (word)(prod >> WORD_BITS);
+		}
+		t[i + n] = carry;
+	}
+	t[2 * n] = 0;
+	bignum_fixedredc(r, t, m, minv, n);
+}
+
+/**
+ * Montgomery squaring of an n word operand, r = a * a * R^-1 mod m, computing the cross
+ * products once and doubling them as bignum_schoolsquare does. r may be the same array as a.
+ */
+ALWAYS_INLINE void bignum_fixedsquare(word* r, word* a, word* m, word minv, int n, word* t) {
+	word carry;
+	int i, j;
+	dword prod;
+	for(j = 0; j <= 2 * n; j++) t[j] = 0;
+	for(i = 0; i < n - 1; i++) {
+		carry = 0;
+		UNROLL
+		for(j = i + 1; j < n; j++) {
+			prod = (dword)a[i] * a[j] + t[i + j] + carry; /* Can not overflow */
+			t[i + j] = (word)prod;
+			carry = (word)(prod >> WORD_BITS);
+		}
+		t[i + n] = carry;
+	}
+	for(j = 2 * n - 1; j > 0; j--) t[j] = (t[j] << 1) | (t[j - 1] >> (WORD_BITS - 1));
+	t[0] <<= 1;
+	carry = 0;
+	for(i = 0; i < n; i++) {
+		prod = (dword)a[i] * a[i] + t[2 * i] + carry;
+		t[2 * i] = (word)prod;
+		prod = (dword)t[2 * i + 1] + (word)(prod >> WORD_BITS);
+		t[2 * i + 1] = (word)prod;
+		carry = (word)(prod >> WORD_BITS);
+	}
+	bignum_fixedredc(r, t, m, minv, n);
+}
+
+/**
+ * Copy b into n words at data, zero padding the high words.
+ */
+ALWAYS_INLINE void bignum_fixedload(bignum* b, word* data, int n) {
+	int i;
+	for(i = 0; i < b->length; i++) data[i] = b->data[i];
+	for(; i < n; i++) data[i] = 0;
+}
+
+/**
+ * Sliding window exponentiation as in bignum_mont_modpow, with every value held in n word
+ * arrays provided by the caller: table has room for 2^(WINDOW_MAX - 1) values, x, one and
+ * r2 for n words each and t for 2n + 1 words. result = base^exponent mod modulus
+ */
+ALWAYS_INLINE void bignum_fixedmodpow(bignum_mont* mont, bignum* base, bignum* exponent, bignum* result,
+		int n, word* table, word* x, word* one, word* r2, word* t) {
+	word *m = mont->modulus->data, minv = mont->minv;
+	int i = bignum_bitlength(exponent) - 1, j, k, length, value, started = 0, size;
+	bignum* reduced;
+	k = bignum_windowsize(i + 1);
+	size = 1 << (k - 1);
+	bignum_fixedload(mont->r2, r2, n);
+	bignum_fixedload(&NUMS[1], one, n);
+	if(bignum_geq(base, mont->modulus)) {
+		reduced = bignum_push();
+		bignum_remainder(base, mont->modulus, reduced);
+		bignum_fixedload(reduced, x, n);
+		bignum_pop(1);
+	}
+	else bignum_fixedload(base, x, n);
+	bignum_fixedmultiply(table, x, r2, m, minv, n, t);
+	if(size > 1) bignum_fixedsquare(x, table, m, minv, n, t);
+	for(j = 1; j < size; j++) bignum_fixedmultiply(table + j * n, table + (j - 1) * n, x, m, minv, n, t);
+	
+	bignum_fixedmultiply(x, one, r2, m, minv, n, t);
+	while(i >= 0) {
+		value = bignum_window(exponent, i, k, &length);
+		if(started) for(j = 0; j < length; j++) bignum_fixedsquare(x, x, m, minv, n, t);
+		if(value != 0) {
+			if(started) bignum_fixedmultiply(x, x, table + (value >> 1) * n, m, minv, n, t);
+			else for(j = 0; j < n; j++) x[j] = table[(value >> 1) * n + j];
+			started = 1;
+		}
+		i -= length;
+	}
+	bignum_fixedmultiply(x, x, one, m, minv, n, t);
+	bignum_reserve(result, n);
+	result->length = 0;
+	for(j = 0; j < n; j++) {
+		result->data[j] = x[j];
+		if(x[j] != 0) result->length = j + 1;
+	}
+}
+
+/**
+ * Define bignum_mont_modpow<bits>, exponentiation modulo a modulus of exactly bits / WORD_BITS
+ * words, with all of its storage on the stack.
+ */
+#define BIGNUM_FIXED(bits) \
+void bignum_mont_modpow##bits(bignum_mont* mont, bignum* base, bignum* exponent, bignum* result) { \
+	word table[(1 << (WINDOW_MAX - 1)) * FIXED_WORDS(bits)]; \
+	word x[FIXED_WORDS(bits)], one[FIXED_WORDS(bits)], r2[FIXED_WORDS(bits)]; \
+	word t[2 * FIXED_WORDS(bits) + 1]; \
+	bignum_fixedmodpow(mont, base, exponent, result, FIXED_WORDS(bits), table, x, one, r2, t); \
+}
+
+/* RSA moduli of 1024 to 4096 bits, and their halves for the CRT exponentiations */
+BIGNUM_FIXED(512)
+BIGNUM_FIXED(1024)
+BIGNUM_FIXED(1536)
+BIGNUM_FIXED(2048)
+BIGNUM_FIXED(3072)
+BIGNUM_FIXED(4096)
+
+/**
+ * Pick the fixed width exponentiation for a modulus of the given number of words, or NULL
+ * if it is not one of the standard sizes.
+ */
+void (*bignum_fixedpow(int words))(bignum_mont*, bignum*, bignum*, bignum*) {
+	switch(words * WORD_BITS) {
+		case 512: return bignum_mont_modpow512;
+		case 1024: return bignum_mont_modpow1024;
+		case 1536: return bignum_mont_modpow1536;
+		case 2048: return bignum_mont_modpow2048;
+		case 3072: return bignum_mont_modpow3072;
+		case 4096: return bignum_mont_modpow4096;
+	}
+	return NULL;
+}
+
+#ifdef SIMD_X86
+/**
+ * Define a batched Montgomery multiplication r = a * b * R^-1 mod modulus for every lane,
+ * with the given vector type and intrinsic prefix ("mm" and "si" name the variants of the
+ * instruction set). The operands are below 2 * modulus and so is the result. Each of the
+ * digits steps adds a_i * b and the multiple of the modulus that clears the lowest digit
+ * to t, which is then shifted down a digit. Sums stay in 64 bits (see bignum_batch_init)
+ * so carries are only propagated once at the end. t has room for digits * lanes words and
+ * r may be the same array as a or b.
+ */
+#define BIGNUM_BATCH(name, isa, vec, lanes, mm, si, set1) \
+__attribute__((target(isa))) \
+void name(bignum_batch* batch, batchword* r, batchword* a, batchword* b, batchword* t) { \
+	vec mask = set1(batch->mask), minv = set1(batch->minv), zero = mm##_setzero_##si(); \
+	vec ai, q, x, carry; \
+	__m128i shift = _mm_cvtsi32_si128(batch->bits); \
+	batchword* m = batch->modulus; \
+	int i, j, n = batch->digits; \
+	for(j = 0; j < n; j++) mm##_storeu_##si((vec*)(t + j * lanes), zero); \
+	for(i = 0; i < n; i++) { \
+		ai = mm##_loadu_##si((vec*)(a + i * lanes)); \
+		x = mm##_add_epi64(mm##_loadu_##si((vec*)t), mm##_mul_epu32(ai, mm##_loadu_##si((vec*)b))); \
+		q = mm##_and_##si(mm##_mul_epu32(mm##_and_##si(x, mask), minv), mask); \
+		carry = mm##_srl_epi64(mm##_add_epi64(x, mm##_mul_epu32(q, mm##_loadu_##si((vec*)m))), shift); \
+		for(j = 1; j < n; j++) { \
+			x = mm##_add_epi64(mm##_mul_epu32(ai, mm##_loadu_##si((vec*)(b + j * lanes))), \
+				mm##_mul_epu32(q, mm##_loadu_##si((vec*)(m + j * lanes)))); \
+			x = mm##_add_epi64(x, mm##_add_epi64(mm##_loadu_##si((vec*)(t + j * lanes)), carry)); \
+			mm##_storeu_##si((vec*)(t + (j - 1) * lanes), x); \
+			carry = zero; \
+		} \
+		mm##_storeu_##si((vec*)(t + (n - 1) * lanes), carry); \
+	} \
+	carry = zero; \
+	for(j = 0; j < n; j++) { \
+		x = mm##_add_epi64(mm##_loadu_##si((vec*)(t + j * lanes)), carry); \
+		mm##_storeu_##si((vec*)(r + j * lanes), mm##_and_##si(x, mask)); \
+		carry = mm##_srl_epi64(x, shift); \
+	} \
+}
+
+BIGNUM_BATCH(bignum_batchmultiply4, "avx2", __m256i, 4, _mm256, si256, _mm256_set1_epi64x)
+BIGNUM_BATCH(bignum_batchmultiply8, "avx512f", __m512i, 8, _mm512, si512, _mm512_set1_epi64)
+#endif
+
+/**
+ * Store the digits of b in lane of x, as described for bignum_batch.
+ */
+void bignum_batch_load(bignum_batch* batch, bignum* b, batchword* x, int lane) {
+	int i, j = 0, have = 0;
+	dword buffer = 0;
+	for(i = 0; i < batch->digits; i++) {
+		while(have < batch->bits) {
+			buffer |= (dword)(j < b->length ? b->data[j] : 0) << have;
+			j++;
+			have += WORD_BITS;
+		}
+		x[i * batch->lanes + lane] = (batchword)buffer & batch->mask;
+		buffer >>= batch->bits;
+		have -= batch->bits;
+	}
+}
+
+/**
+ * Put the normalized digits in lane of x back together into b.
+ */
+void bignum_batch_store(bignum_batch* batch, batchword* x, int lane, bignum* b) {
+	int i, j = 0, have = 0;
+	dword buffer = 0;
+	bignum_reserve(b, (batch->digits * batch->bits + WORD_BITS - 1) / WORD_BITS);
+	for(i = 0; i < batch->digits; i++) {
+		buffer |= (dword)x[i * batch->lanes + lane] << have;
+		for(have += batch->bits; have >= WORD_BITS; have -= WORD_BITS) {
+			b->data[j++] = (word)buffer;
+			buffer >>= WORD_BITS;
+		}
+	}
+	if(have > 0) b->data[j++] = (word)buffer;
+	b->length = j;
+	while(b->length > 0 && b->data[b->length - 1] == 0) b->length--;
+}
+
+/**
+ * Set up batched exponentiation modulo the modulus of mont, which has to outlive it. The
+ * digit size is the largest (up to 28 bits) for which digits * 2^(2 * bits + 1), the most a
+ * digit of a product can collect, plus the carry into it still fits in 64 bits. That is
+ * 28 bit digits up to about 3550 bit moduli and 27 bits up to about 13800 bits.
+ */
+bignum_batch* bignum_batch_init(bignum_mont* mont) {
+	bignum_batch* batch = malloc(sizeof(bignum_batch));
+	bignum* r2 = bignum_push();
+	int l, size = bignum_bitlength(mont->modulus);
+	batch->mont = mont;
+	batch->lanes = 1;
+	batch->multiply = NULL;
+	batch->modulus = batch->r2 = batch->one = NULL;
+	for(batch->bits = 28; batch->bits >= 21; batch->bits--) {
+		batch->digits = (size + 2 + batch->bits - 1) / batch->bits;
+		if(batch->digits < 1LL << (63 - 2 * batch->bits)) break;
+	}
+#ifdef SIMD_X86
+	if(batch->bits >= 21 && (batchLanes == 0 || batchLanes >= 8) && __builtin_cpu_supports("avx512f")) {
+		batch->lanes = 8;
+		batch->multiply = bignum_batchmultiply8;
+	}
+	else if(batch->bits >= 21 && (batchLanes == 0 || batchLanes >= 4) && __builtin_cpu_supports("avx2")) {
+		batch->lanes = 4;
+		batch->multiply = bignum_batchmultiply4;
+	}
+#endif
+	if(batch->lanes == 1) {
+		bignum_pop(1);
+		return batch;
+	}
+	batch->mask = ((batchword)1 << batch->bits) - 1;
+	batch->minv = (batchword)mont->minv & batch->mask; /* -modulus^-1 mod RADIX, reduced */
+	batch->modulus = malloc(3 * batch->digits * batch->lanes * sizeof(batchword));
+	batch->r2 = batch->modulus + batch->digits * batch->lanes;
+	batch->one = batch->r2 + batch->digits * batch->lanes;
+	/* R^2 mod modulus for converting into the Montgomery domain, and 1 for converting out */
+	bignum_fromint(r2, 1);
+	bignum_ilshift(r2, 2 * batch->bits * batch->digits);
+	bignum_imodulate(r2, mont->modulus);
+	for(l = 0; l < batch->lanes; l++) {
+		bignum_batch_load(batch, mont->modulus, batch->modulus, l);
+		bignum_batch_load(batch, r2, batch->r2, l);
+		bignum_batch_load(batch, &NUMS[1], batch->one, l);
+	}
+	bignum_pop(1);
+	return batch;
+}
+
+/**
+ * Free resources used by a batch context.
+ */
+void bignum_batch_deinit(bignum_batch* batch) {
+	free(batch->modulus);
+	free(batch);
+}
+
+/**
+ * Set results[i] = bases[i]^exponent mod modulus for the count (at most batch->lanes)
+ * numbers, by the same sliding window as bignum_mont_modpow run in every lane at once. The
+ * exponent is shared, so all lanes take the same steps. Unused lanes work on zero.
+ */
+void bignum_batch_modpow(bignum_batch* batch, bignum** bases, bignum* exponent, bignum** results, int count) {
+	STATS_ENTER(STAT_BATCH_MODPOW, count * batch->mont->modulus->length + exponent->length)
+	bignum *storage, *reduced;
+	batchword *table, *x, *t;
+	int i = bignum_bitlength(exponent) - 1, j, k, l, length, value, started = 0, size;
+	int width = batch->digits * batch->lanes;
+	if(batch->lanes == 1) {
+		for(l = 0; l < count; l++) bignum_mont_modpow(batch->mont, bases[l], exponent, results[l]);
+		STATS_LEAVE();
+		return;
+	}
+	k = bignum_windowsize(i + 1);
+	size = 1 << (k - 1);
+	/* The table, x and t all live in one scratch bignum */
+	storage = bignum_push();
+	reduced = bignum_push();
+	bignum_reserve(storage, (size + 2) * width * (int)(sizeof(batchword) / sizeof(word)));
+	table = (batchword*)storage->data;
+	x = table + size * width;
+	t = x + width;
+	for(l = 0; l < batch->lanes; l++) {
+		if(l >= count) bignum_batch_load(batch, &NUMS[0], x, l);
+		else if(bignum_geq(bases[l], batch->mont->modulus)) {
+			bignum_remainder(bases[l], batch->mont->modulus, reduced);
+			bignum_batch_load(batch, reduced, x, l);
+		}
+		else bignum_batch_load(batch, bases[l], x, l);
+	}
+	batch->multiply(batch, table, x, batch->r2, t);
+	if(size > 1) batch->multiply(batch, x, table, table, t);
+	for(j = 1; j < size; j++) batch->multiply(batch, table + j * width, table + (j - 1) * width, x, t);
+	
+	batch->multiply(batch, x, batch->one, batch->r2, t);
+	while(i >= 0) {
+		value = bignum_window(exponent, i, k, &length);
+		if(started) for(j = 0; j < length; j++) batch->multiply(batch, x, x, x, t);
+		if(value != 0) {
+			if(started) batch->multiply(batch, x, x, table + (value >> 1) * width, t);
+			else memcpy(x, table + (value >> 1) * width, width * sizeof(batchword));
+			started = 1;
+		}
+		i -= length;
+	}
+	/* Out of the domain the value is at most the modulus, which it only reaches for 0 */
+	batch->multiply(batch, x, x, batch->one, t);
+	for(l = 0; l < count; l++) {
+		bignum_batch_store(batch, x, l, results[l]);
+		if(bignum_geq(results[l], batch->mont->modulus)) bignum_isubtract(results[l], batch->mont->modulus);
+	}
+	bignum_pop(2);
+	STATS_LEAVE();
+}
+
+/**
+ * Perform modular exponentiation by repeated squaring. This will compute
+ * result = base^exponent mod modulus. Odd moduli (all of the RSA and primality testing
+ * cases) go through the Montgomery domain to avoid dividing after each multiply.
+ */
+void bignum_modpow(bignum* base, bignum* exponent, bignum* modulus, bignum* result) {
+	STATS_ENTER(STAT_MODPOW, base->length + exponent->length + modulus->length)
+	bignum *a, *b, *c;
+	bignum_mont* mont;
+	if(modulus->length > 0 && modulus->data[0] % 2 == 1) {
+		mont = bignum_mont_init(modulus);
+		bignum_mont_modpow(mont, base, exponent, result);
+		bignum_mont_deinit(mont);
+		STATS_LEAVE();
+		return;
+	}
+	a = bignum_push(); b = bignum_push(); c = bignum_push();
+	bignum_copy(base, a);
+	bignum_copy(exponent, b);
+	bignum_copy(modulus, c);
+	bignum_fromint(result, 1);
+	while(bignum_greater(b, &NUMS[0])) {
+		if(b->data[0] & 1) {
+			bignum_imultiply(result, a);
+			bignum_imodulate(result, c);
+		}
+		bignum_irshift(b, 1);
+		bignum_isquare(a);
+		bignum_imodulate(a, c);
+	}
+	bignum_pop(3);
+	STATS_LEAVE();
+}
+
+/**
+ * Calculate result = (a + b) mod n, for a and b already reduced modulo n.
+ */
+void bignum_modadd(bignum* result, bignum* a, bignum* b, bignum* n) {
+	bignum_add(result, a, b);
+	if(bignum_geq(result, n)) bignum_isubtract(result, n);
+}
+
+/**
+ * Calculate result = (a - b) mod n, for a and b already reduced modulo n.
+ */
+void bignum_modsubtract(bignum* result, bignum* a, bignum* b, bignum* n) {
+	bignum* temp = bignum_push();
+	if(bignum_less(a, b)) {
+		bignum_add(temp, a, n);
+		bignum_subtract(result, temp, b);
+	}
+	else bignum_subtract(result, a, b);
+	bignum_pop(1);
+}
+
+/**
+ * Calculate result = a / 2 mod n for odd n, in place.
+ */
+void bignum_modhalve(bignum* a, bignum* n) {
+	if(a->length > 0 && a->data[0] & 1) bignum_iadd(a, n);
+	bignum_irshift(a, 1);
+}
+
+/**
+ * Compute the gcd of two single words by the binary method.
+ */
+word wordGcd(word a, word b) {
+	word temp;
+	int shift = 0;
+	if(a == 0) return b;
+	if(b == 0) return a;
+	while(((a | b) & 1) == 0) {
+		a >>= 1;
+		b >>= 1;
+		shift++;
+	}
+	while((a & 1) == 0) a >>= 1;
+	while(b != 0) {
+		while((b & 1) == 0) b >>= 1;
+		if(a > b) {
+			temp = a;
+			a = b;
+			b = temp;
+		}
+		b -= a;
+	}
+	return a << shift;
+}
+
+/**
+ * Compute the gcd of two bignums by the binary method, result = gcd(b1, b2). Common
+ * factors of two are taken out, then the smaller odd value is repeatedly subtracted from
+ * the larger and the difference shifted down until it is odd again, so there is no
+ * division. If one operand is much shorter than the other a single division first brings
+ * them to the same size, and a single word operand finishes in machine words (the common
+ * case of randExponent).
+ */
+void bignum_gcd(bignum* b1, bignum* b2, bignum* result) {
+	STATS_ENTER(STAT_GCD, b1->length + b2->length)
+	bignum *a = bignum_push(), *b = bignum_push(), *temp;
+	int shift;
+	if(b1->length < b2->length) {
+		temp = b1;
+		b1 = b2;
+		b2 = temp;
+	}
+	if(bignum_iszero(b2)) {
+		bignum_copy(b1, result);
+		bignum_pop(2);
+		STATS_LEAVE();
+		return;
+	}
+	if(b2->length == 1) {
+		bignum_fromint(result, wordGcd(bignum_modword(b1, b2->data[0]), b2->data[0]));
+		bignum_pop(2);
+		STATS_LEAVE();
+		return;
+	}
+	if(b1->length > b2->length + 1) bignum_remainder(b1, b2, a);
+	else bignum_copy(b1, a);
+	bignum_copy(b2, b);
+	if(bignum_iszero(a)) {
+		bignum_copy(b, result);
+		bignum_pop(2);
+		STATS_LEAVE();
+		return;
+	}
+	shift = MIN(bignum_ctz(a), bignum_ctz(b));
+	bignum_irshift(a, bignum_ctz(a));
+	bignum_irshift(b, bignum_ctz(b));
+	/* Both odd from here, so their difference is even */
+	while(1) {
+		if(bignum_greater(a, b)) {
+			temp = a;
+			a = b;
+			b = temp;
+		}
+		bignum_isubtract(b, a);
+		if(bignum_iszero(b)) break;
+		bignum_irshift(b, bignum_ctz(b));
+	}
+	bignum_copy(a, result);
+	bignum_ilshift(result, shift);
+	bignum_pop(2);
+	STATS_LEAVE();
+}
+
+/**
+ * Compute the inverse of a modulo the odd m by the binary extended gcd, result = a^-1 mod m.
+ * Throughout, u = x1 * a and v = x2 * a modulo m. Halving u or v halves its cofactor (adding
+ * m first when that is odd) and subtracting one from the other subtracts the cofactors, so
+ * only shifts, adds and subtracts are needed until u or v reaches 1.
+ */
+void bignum_oddinverse(bignum* a, bignum* m, bignum* result) {
+	bignum *u = bignum_push(), *v = bignum_push(), *x1 = bignum_push(), *x2 = bignum_push();
+	if(bignum_geq(a, m)) bignum_remainder(a, m, u);
+	else bignum_copy(a, u);
+	bignum_copy(m, v);
+	bignum_fromint(x1, 1);
+	bignum_fromint(x2, 0);
+	x2->length = 0;
+	while(!bignum_equal(u, &NUMS[1]) && !bignum_equal(v, &NUMS[1])) {
+		/* No inverse if a shares a factor with m, stop rather than loop forever */
+		if(bignum_iszero(u) || bignum_iszero(v)) break;
+		while((u->data[0] & 1) == 0) {
+			bignum_irshift(u, 1);
+			bignum_modhalve(x1, m);
+		}
+		while((v->data[0] & 1) == 0) {
+			bignum_irshift(v, 1);
+			bignum_modhalve(x2, m);
+		}
+		if(bignum_geq(u, v)) {
+			bignum_isubtract(u, v);
+			bignum_modsubtract(x1, x1, x2, m);
+		}
+		else {
+			bignum_isubtract(v, u);
+			bignum_modsubtract(x2, x2, x1, m);
+		}
+	}
+	bignum_copy(bignum_equal(u, &NUMS[1]) ? x1 : x2, result);
+	bignum_pop(4);
+}
+
+/**
+ * Compute the inverse of a mod m. Or, result = a^-1 mod m. An odd m goes straight to
+ * bignum_oddinverse. For an even m (phi, when finding the private exponent) a has to be
+ * odd, so y = m^-1 mod a can be found that way instead, and then
+ * result = (1 + m * (a - y)) / a, where the division is exact. For the usual small public
+ * exponent that is a single word division.
+ */
+void bignum_inverse(bignum* a, bignum* m, bignum* result) {
+	STATS_ENTER(STAT_INVERSE, a->length + m->length)
+	bignum *y = bignum_push(), *t = bignum_push(), *r = bignum_push();
+	if(m->length > 0 && m->data[0] & 1) {
+		bignum_oddinverse(a, m, result);
+		bignum_pop(3);
+		STATS_LEAVE();
+		return;
+	}
+	if(bignum_geq(a, m)) bignum_remainder(a, m, r);
+	else bignum_copy(a, r);
+	if(bignum_equal(r, &NUMS[1])) {
+		bignum_fromint(result, 1);
+		bignum_pop(3);
+		STATS_LEAVE();
+		return;
+	}
+	bignum_oddinverse(m, r, y);
+	bignum_subtract(t, r, y);
+	bignum_imultiply(t, m);
+	bignum_iadd(t, &NUMS[1]);
+	bignum_divide(result, y, t, r);
+	bignum_pop(3);
+	STATS_LEAVE();
+}
+
+/**
+ * Compute the jacobi symbol, J(ac, nc), for odd positive nc. This is the binary method:
+ * factors of two are shifted out of a, flipping the sign when n = 3 or 5 mod 8, and with
+ * both values odd the smaller is subtracted from the larger, swapping them first (by
+ * quadratic reciprocity, flipping the sign if both are 3 mod 4) when a < n. The residues
+ * mod 4 and mod 8 come straight from the low word.
+ */
+int bignum_jacobi(bignum* ac, bignum* nc) {
+	STATS_ENTER(STAT_JACOBI, ac->length + nc->length)
+	bignum *a = bignum_push(), *n = bignum_push(), *temp;
+	int mult = 1, twos;
+	if(ac->length > nc->length) bignum_remainder(ac, nc, a);
+	else bignum_copy(ac, a);
+	bignum_copy(nc, n);
+	while(bignum_isnonzero(a)) {
+		twos = bignum_ctz(a);
+		bignum_irshift(a, twos);
+		if(twos % 2 == 1 && ((n->data[0] & 7) == 3 || (n->data[0] & 7) == 5)) mult = -mult;
+		if(bignum_less(a, n)) {
+			temp = a;
+			a = n;
+			n = temp;
+			if((a->data[0] & 3) == 3 && (n->data[0] & 3) == 3) mult = -mult;
+		}
+		bignum_isubtract(a, n);
+	}
+	if(!bignum_equal(n, &NUMS[1])) mult = 0;
+	bignum_pop(2);
+	STATS_LEAVE();
+	return mult;
+}
+
+/**
+ * Check whether a is a Euler witness for n. That is, if a^(n - 1)/2 != Ja(a, n) mod n
+ */
+int solovayPrime(int a, bignum* n) {
+	bignum *ab = bignum_push(), *res = bignum_push(), *pow = bignum_push();
+	bignum *modpow = bignum_push();
+	int x, result;
+
+	bignum_fromint(ab, a);
+	x = bignum_jacobi(ab, n);
+	if(x == -1) bignum_subtract(res, n, &NUMS[1]);
+	else bignum_fromint(res, x);
+	bignum_copy(n, pow);
+	bignum_isubtract(pow, &NUMS[1]);
+	bignum_irshift(pow, 1);
+	bignum_modpow(ab, pow, n, modpow);
+	
+	result = !bignum_equal(res, &NUMS[0]) && bignum_equal(modpow, res);
+	bignum_pop(4);
+	return result;
+}
+
+/**
+ * Check whether n is a strong probable prime to base a (one round of Miller-Rabin), where
+ * n - 1 = d * 2^s with d odd and mont is a Montgomery context for n. A prime n always
+ * passes, while an odd composite passes for at most a quarter of the bases.
+ */
+int millerRabinPrime(int a, bignum_mont* mont, bignum* d, int s) {
+	bignum *ab = bignum_push(), *x = bignum_push(), *one = bignum_push(), *minusone = bignum_push();
+	int result = 0;
+	bignum_fromint(ab, a);
+	bignum_mont_modpow(mont, ab, d, x);
+	bignum_mont_to(mont, x, x);
+	bignum_mont_to(mont, &NUMS[1], one);
+	bignum_subtract(minusone, mont->modulus, one);
+	if(bignum_equal(x, one) || bignum_equal(x, minusone)) result = 1;
+	/* Otherwise one of x^2, x^4, .., x^(2^(s - 1)) has to be -1 */
+	while(!result && --s > 0) {
+		bignum_mont_square(mont, x, x);
+		if(bignum_equal(x, minusone)) result = 1;
+		else if(bignum_equal(x, one)) break;
+	}
+	bignum_pop(4);
+	return result;
+}
+
+/**
+ * Calculate the integer square root of b, result = floor(sqrt(b)), by Newton iteration
+ * x = (x + b / x) / 2 from a starting point above the root.
+ */
+void bignum_sqrt(bignum* b, bignum* result) {
+	bignum *x = bignum_push(), *y = bignum_push(), *q = bignum_push(), *r = bignum_push();
+	int i, half = (b->length + 1) / 2;
+	if(bignum_iszero(b)) {
+		bignum_fromint(result, 0);
+		bignum_pop(4);
+		return;
+	}
+	/* RADIX^half is above the root */
+	bignum_reserve(x, half + 1);
+	for(i = 0; i < half; i++) x->data[i] = 0;
+	x->data[half] = 1;
+	x->length = half + 1;
+	while(1) {
+		bignum_divide(q, r, b, x);
+		bignum_add(y, x, q);
+		bignum_irshift(y, 1);
+		if(bignum_geq(y, x)) break;
+		bignum_copy(y, x);
+	}
+	bignum_copy(x, result);
+	bignum_pop(4);
+}
+
+/**
+ * Check whether n is a strong Lucas probable prime, with the parameters chosen as Selfridge
+ * suggests: D is the first of 5, -7, 9, -11, .. with Jacobi symbol (D / n) = -1, P = 1 and
+ * Q = (1 - D) / 4. With n + 1 = d * 2^s and d odd, a prime n has U_d = 0 or V_(d 2^r) = 0
+ * for some r < s. The sequences are run in the Montgomery domain of mont, a context for n.
+ * Together with a base 2 strong probable prime test this is the Baillie-PSW test.
+ */
+int lucasPrime(bignum_mont* mont) {
+	bignum *n = mont->modulus;
+	bignum *dm = bignum_push(), *qm = bignum_push(), *d = bignum_push(), *temp = bignum_push();
+	bignum *u = bignum_push(), *v = bignum_push(), *qk = bignum_push(), *t = bignum_push();
+	int dd = 5, j, i, s, result = 0;
+	/* No D works for perfect squares */
+	bignum_sqrt(n, temp);
+	bignum_square(t, temp);
+	if(bignum_equal(t, n)) {
+		bignum_pop(8);
+		return 0;
+	}
+	while(1) {
+		/* dm = D mod n */
+		bignum_fromint(temp, dd > 0 ? dd : -dd);
+		bignum_imodulate(temp, n);
+		if(dd < 0 && bignum_isnonzero(temp)) bignum_subtract(dm, n, temp);
+		else bignum_copy(temp, dm);
+		j = bignum_jacobi(dm, n);
+		if(j == -1) break;
+		/* n shares a factor with D, so it is prime only if it is that factor */
+		if(j == 0) {
+			bignum_fromint(temp, dd > 0 ? dd : -dd);
+			result = bignum_leq(n, temp);
+			bignum_pop(8);
+			return result;
+		}
+		dd = dd > 0 ? -(dd + 2) : -dd + 2;
+	}
+	/* Q = (1 - D) / 4, reduced modulo n */
+	if(dd > 0) {
+		bignum_fromint(temp, (dd - 1) / 4);
+		bignum_imodulate(temp, n);
+		if(bignum_isnonzero(temp)) bignum_subtract(qm, n, temp);
+		else bignum_copy(temp, qm);
+	}
+	else {
+		bignum_fromint(qm, (1 - dd) / 4);
+		bignum_imodulate(qm, n);
+	}
+	bignum_mont_to(mont, dm, dm);
+	bignum_mont_to(mont, qm, qm);
+	/* n + 1 = d * 2^s */
+	bignum_add(d, n, &NUMS[1]);
+	s = bignum_ctz(d);
+	bignum_irshift(d, s);
+	/* Start from U_1 = 1, V_1 = P = 1, Q^1 at the top bit of d, and move down the bits with
+	 * U_2k = U_k V_k, V_2k = V_k^2 - 2 Q^k and U_(k+1) = (P U_k + V_k) / 2,
+	 * V_(k+1) = (D U_k + P V_k) / 2 */
+	bignum_mont_to(mont, &NUMS[1], u);
+	bignum_copy(u, v);
+	bignum_copy(qm, qk);
+	for(i = bignum_bitlength(d) - 2; i >= 0; i--) {
+		bignum_mont_multiply(mont, u, u, v);
+		bignum_mont_square(mont, v, v);
+		bignum_modadd(temp, qk, qk, n);
+		bignum_modsubtract(v, v, temp, n);
+		bignum_mont_square(mont, qk, qk);
+		if(bignum_testbit(d, i)) {
+			bignum_modadd(temp, u, v, n);
+			bignum_mont_multiply(mont, t, dm, u);
+			bignum_modadd(v, t, v, n);
+			bignum_modhalve(v, n);
+			bignum_copy(temp, u);
+			bignum_modhalve(u, n);
+			bignum_mont_multiply(mont, qk, qk, qm);
+		}
+	}
+	result = bignum_iszero(u) || bignum_iszero(v);
+	for(i = 1; i < s && !result; i++) {
+		bignum_mont_square(mont, v, v);
+		bignum_modadd(temp, qk, qk, n);
+		bignum_modsubtract(v, v, temp, n);
+		bignum_mont_square(mont, qk, qk);
+		result = bignum_iszero(v);
+	}
+	bignum_pop(8);
+	return result;
+}
+
+/**
+ * Random number in [0, RAND_MAX] for code that may run on several threads at once, using
+ * a per thread state. A thread that has not been given a seed takes one from rand().
+ */
+int threadRand() {
+	if(randomSeed == 0) randomSeed = (unsigned int)rand() + 1;
+	return rand_r(&randomSeed);
+}
+
+/**
+ * Whether the primality test running on this thread should give up, see primeCancel.
+ */
+int primeCancelled() {
+	return primeCancel != NULL && __atomic_load_n(primeCancel, __ATOMIC_RELAXED);
+}
+
+/**
+ * Seconds on a monotonic wall clock, for timing work spread over several threads (clock()
+ * adds up the processor time of all of them).
+ */
+double wallSeconds() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+/**
+ * Number of worker threads to use, from threadCount.
+ */
+int workerThreads() {
+	if(threadCount > 0) return threadCount;
+	return MAX(1, (int)sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+/**
+ * Test if n is probably prime, with the test selected by primalityTest. k is the number of
+ * Solovay-Strassen rounds, each of which lets a composite through with probability at most
+ * 1/2. A Miller-Rabin round has at most a 1/4 chance, so (k + 1) / 2 of those give the same
+ * confidence, and they start with base 2 which throws out almost every composite. The
+ * Baillie-PSW test (base 2 Miller-Rabin plus a strong Lucas test) has no known
+ * counterexamples and costs about three exponentiations, whatever k is. Once primeCancelled
+ * the test gives up between rounds and returns 0.
+ */
+int probablePrime(bignum* n, int k) {
+	bignum_mont* mont;
+	bignum* d;
+	int s, rounds, result = 1;
+	if(bignum_equal(n, &NUMS[2])) return 1;
+	else if(n->data[0] % 2 == 0 || bignum_equal(n, &NUMS[1])) return 0;
+	if(primalityTest == PRIMALITY_SOLOVAY_STRASSEN) {
+		while(k-- > 0) {
+			if(primeCancelled()) return 0;
+			if(n->length <= 1) { /* Prevent a > n */
+				if(!solovayPrime(threadRand() % (n->data[0] - 2) + 2, n)) return 0;
+			}
+			else {
+				int wit = threadRand() % (RAND_MAX - 2) + 2;
+				if(!solovayPrime(wit, n)) return 0;
+			}
+		}
+		return 1;
+	}
+	if(bignum_equal(n, &NUMS[3])) return 1;
+	/* n - 1 = d * 2^s */
+	d = bignum_push();
+	bignum_subtract(d, n, &NUMS[1]);
+	s = bignum_ctz(d);
+	bignum_irshift(d, s);
+	mont = bignum_mont_init(n);
+	result = millerRabinPrime(2, mont, d, s);
+	if(primalityTest == PRIMALITY_BAILLIE_PSW) {
+		if(result) result = !primeCancelled() && lucasPrime(mont);
+	}
+	else {
+		for(rounds = (k + 1) / 2 - 1; result && rounds > 0; rounds--) {
+			/* Random base in [2, n - 2] */
+			if(primeCancelled()) result = 0;
+			else if(n->length <= 1) result = millerRabinPrime(threadRand() % (n->data[0] - 3) + 2, mont, d, s);
+			else result = millerRabinPrime(threadRand() % (RAND_MAX - 2) + 2, mont, d, s);
+		}
+	}
+	bignum_mont_deinit(mont);
+	bignum_pop(1);
+	return result;
+}
+
+/**
+ * Generate a random odd number with a specified number of digits, the starting point of a
+ * prime search. This will generate a base 10 digit string of given length and convert it.
+ */
+void randCandidate(int numDigits, bignum* result) {
+	char *string = malloc((numDigits + 1) * sizeof(char));
+	int i;
+	string[0] = (rand() % 9) + '1'; /* No leading zeros */
+	string[numDigits - 1] = (rand() % 5) * 2 + '1'; /* Last digit is odd */
+	for(i = 1; i < numDigits - 1; i++) string[i] = (rand() % 10) + '0';
+	string[numDigits] = '\0';
+	bignum_fromstring(result, string);
+	free(string);
+}
+
+/**
+ * Generate a random odd number of exactly the given number of bits (at least 2) with the
+ * top two bits set, the starting point of a prime search for a key of a set size. The
+ * product of two such numbers has exactly as many bits as the two of them together.
+ */
+void randBitsCandidate(int bits, bignum* result) {
+	int i, j, n = (bits + WORD_BITS - 1) / WORD_BITS;
+	bignum_reserve(result, n);
+	for(i = 0; i < n; i++) {
+		result->data[i] = 0;
+		for(j = 0; j < WORD_BITS; j += 8) result->data[i] |= (word)(rand() & 0xff) << j;
+	}
+	result->data[n - 1] &= ((word)2 << (bits - 1) % WORD_BITS) - 1;
+	result->data[(bits - 1) / WORD_BITS] |= (word)1 << (bits - 1) % WORD_BITS;
+	result->data[(bits - 2) / WORD_BITS] |= (word)1 << (bits - 2) % WORD_BITS;
+	result->data[0] |= 1;
+	result->length = n;
+}
+
+/**
+ * Fill in SMALL_PRIMES with a sieve of Eratosthenes. Call before starting any searches.
+ */
+void initSmallPrimes() {
+	int i, j, count = 0, limit = 1 << 15;
+	char* composite;
+	if(smallPrimesReady) return;
+	composite = calloc(limit, sizeof(char)); /* composite[i] is for 2i + 1 */
+	for(i = 1; i < limit && count < SIEVE_PRIMES; i++) {
+		if(composite[i]) continue;
+		SMALL_PRIMES[count++] = 2 * i + 1;
+		for(j = 2 * i * (i + 1); j < limit; j += 2 * i + 1) composite[j] = 1;
+	}
+	free(composite);
+	smallPrimesReady = 1;
+}
+
+/**
+ * Test candidates for a prime search as the given worker, until one of the workers finds
+ * a probable prime. The residues of the candidate modulo the small primes are worked out
+ * once and then moved along with each step, so candidates with a small factor are thrown
+ * out at the cost of a few thousand single word additions.
+ */
+void searchPrime(primeWorker* worker) {
+	primeSearch* search = worker->search;
+	bignum *candidate = bignum_push(), *step = bignum_push();
+	word residues[SIEVE_PRIMES], steps[SIEVE_PRIMES];
+	int i, divisible, small;
+	randomSeed = worker->seed;
+	primeCancel = &search->found;
+	bignum_fromint(step, 2 * worker->id);
+	bignum_add(candidate, search->start, step);
+	bignum_fromint(step, 2 * search->workers);
+	for(i = 0; i < SIEVE_PRIMES; i++) {
+		residues[i] = bignum_modword(candidate, SMALL_PRIMES[i]);
+		steps[i] = bignum_modword(step, SMALL_PRIMES[i]);
+	}
+	/* Below this a candidate could be one of the small primes itself */
+	small = candidate->length == 1 && candidate->data[0] <= SMALL_PRIMES[SIEVE_PRIMES - 1];
+	while(1) {
+		for(i = 0, divisible = 0; i < SIEVE_PRIMES && !divisible; i++) divisible = residues[i] == 0;
+		if(small) divisible = 0;
+		if(__atomic_load_n(&search->found, __ATOMIC_ACQUIRE)) break;
+		if(!divisible) __atomic_fetch_add(&search->candidates, 1, __ATOMIC_RELAXED);
+		if(!divisible && probablePrime(candidate, ACCURACY)) {
+			pthread_mutex_lock(&search->lock);
+			if(!search->found) {
+				search->seconds = wallSeconds() - search->started;
+				bignum_copy(candidate, search->result);
+				__atomic_store_n(&search->found, 1, __ATOMIC_RELEASE);
+			}
+			pthread_mutex_unlock(&search->lock);
+			break;
+		}
+		bignum_iadd(candidate, step);
+		for(i = 0; i < SIEVE_PRIMES; i++) {
+			residues[i] += steps[i];
+			if(residues[i] >= SMALL_PRIMES[i]) residues[i] -= SMALL_PRIMES[i];
+		}
+		small = candidate->length == 1 && candidate->data[0] <= SMALL_PRIMES[SIEVE_PRIMES - 1];
+	}
+	primeCancel = NULL;
+	bignum_pop(2);
+}
+
+/**
+ * Thread body for the workers of searchPrimes.
+ */
+void* primeThread(void* arg) {
+	searchPrime(arg);
+	bignum_scratch_free();
+	return NULL;
+}
+
+/**
+ * Find count primes, each by an increasing search from the odd number in starts. The
+ * searches run concurrently and share the worker threads between them, each search
+ * testing several candidates at a time. If seconds or candidates are not NULL they receive
+ * the time each search took and the number of candidates that got past the sieve to the
+ * probable prime test.
+ */
+void searchPrimes(int count, bignum** starts, bignum** results, double* seconds, long* candidates) {
+	primeSearch* searches = malloc(count * sizeof(primeSearch));
+	primeWorker* workers;
+	pthread_t* ids;
+	int i, j, total = 0, workersPer = MAX(1, workerThreads() / count);
+	initSmallPrimes();
+	for(i = 0; i < count; i++) {
+		searches[i].start = starts[i];
+		searches[i].result = results[i];
+		searches[i].workers = workersPer;
+		searches[i].found = 0;
+		searches[i].candidates = 0;
+		pthread_mutex_init(&searches[i].lock, NULL);
+		total += workersPer;
+	}
+	workers = malloc(total * sizeof(primeWorker));
+	ids = malloc(total * sizeof(pthread_t));
+	for(i = 0; i < count; i++) {
+		for(j = 0; j < workersPer; j++) {
+			workers[i * workersPer + j].search = &searches[i];
+			workers[i * workersPer + j].id = j;
+			workers[i * workersPer + j].seed = (unsigned int)rand() + 1;
+		}
+	}
+	if(total == 1) {
+		searches[0].started = wallSeconds();
+		searchPrime(&workers[0]);
+	}
+	else {
+		for(i = 0; i < count; i++) searches[i].started = wallSeconds();
+		for(i = 0; i < total; i++) {
+			/* Without a thread a worker's share of candidates is skipped, which is fine */
+			if(pthread_create(&ids[i], NULL, primeThread, &workers[i]) != 0) workers[i].id = -1;
+		}
+		/* Every search needs at least one worker */
+		for(i = 0; i < count; i++) {
+			for(j = 0; j < workersPer && workers[i * workersPer + j].id < 0; j++);
+			if(j == workersPer) {
+				workers[i * workersPer].id = 0;
+				searchPrime(&workers[i * workersPer]);
+				workers[i * workersPer].id = -1;
+			}
+		}
+		for(i = 0; i < total; i++) {
+			if(workers[i].id >= 0) pthread_join(ids[i], NULL);
+		}
+	}
+	for(i = 0; i < count; i++) {
+		if(seconds != NULL) seconds[i] = searches[i].seconds;
+		if(candidates != NULL) candidates[i] = searches[i].candidates;
+		pthread_mutex_destroy(&searches[i].lock);
+	}
+	free(searches);
+	free(workers);
+	free(ids);
+}
+
+/**
+ * Generate count random primes with the specified number of digits, each searched for from
+ * a random odd starting point, see searchPrimes.
+ */
+void randPrimes(int count, int numDigits, bignum** results, double* seconds, long* candidates) {
+	bignum** starts = malloc(count * sizeof(bignum*));
+	int i;
+	for(i = 0; i < count; i++) {
+		starts[i] = bignum_init();
+		randCandidate(numDigits, starts[i]);
+	}
+	searchPrimes(count, starts, results, seconds, candidates);
+	for(i = 0; i < count; i++) bignum_deinit(starts[i]);
+	free(starts);
+}
+
+/**
+ * Generate a random prime number, with a specified number of digits. See randPrimes.
+ */
+void randPrime(int numDigits, bignum* result) {
+	randPrimes(1, numDigits, &result, NULL, NULL);
+}
+
+/**
+ * Choose a random public key exponent for the RSA algorithm. The exponent will
+ * be less than the modulus, n, and coprime to phi.
+ */
+void randExponent(bignum* phi, int n, bignum* result) {
+	bignum* gcd = bignum_init();
+	int e = rand() % n;
+	while(1) {
+		bignum_fromint(result, e);
+		bignum_gcd(result, phi, gcd);
+		if(bignum_equal(gcd, &NUMS[1])) {
+			bignum_deinit(gcd);
+			return;
+		}
+		e = (e + 1) % n;
+		if(e <= 2) e = 3;
+	}
+}
+
+/**
+ * Encode the message m using public exponent and modulus, result = m^e mod n
+ */
+void encode(bignum* m, bignum* e, bignum* n, bignum* result) {
+	bignum_modpow(m, e, n, result);
+}
+
+/**
+ * Create a private key from the prime factors p, q and the private exponent d, computing
+ * the values needed for chinese remainder theorem decryption.
+ */
+privateKey* initPrivateKey(bignum* p, bignum* q, bignum* d) {
+	privateKey* key = malloc(sizeof(privateKey));
+	bignum* temp = bignum_init();
+	key->n = bignum_init(); key->d = bignum_init();
+	key->p = bignum_init(); key->q = bignum_init();
+	key->dp = bignum_init(); key->dq = bignum_init(); key->qinv = bignum_init();
+	bignum_copy(p, key->p);
+	bignum_copy(q, key->q);
+	bignum_copy(d, key->d);
+	bignum_multiply(key->n, p, q);
+	bignum_subtract(temp, p, &NUMS[1]);
+	bignum_remainder(d, temp, key->dp); /* dp = d mod (p - 1) */
+	bignum_subtract(temp, q, &NUMS[1]);
+	bignum_remainder(d, temp, key->dq); /* dq = d mod (q - 1) */
+	bignum_remainder(q, p, temp);
+	bignum_inverse(temp, p, key->qinv); /* qinv = q^-1 mod p */
+	key->montp = bignum_mont_init(p);
+	key->montq = bignum_mont_init(q);
+	key->batchp = bignum_batch_init(key->montp);
+	key->batchq = bignum_batch_init(key->montq);
+	bignum_deinit(temp);
+	return key;
+}
+
+/**
+ * Free resources used by a private key.
+ */
+void deinitPrivateKey(privateKey* key) {
+	bignum_deinit(key->n); bignum_deinit(key->d);
+	bignum_deinit(key->p); bignum_deinit(key->q);
+	bignum_deinit(key->dp); bignum_deinit(key->dq); bignum_deinit(key->qinv);
+	bignum_batch_deinit(key->batchp);
+	bignum_batch_deinit(key->batchq);
+	bignum_mont_deinit(key->montp);
+	bignum_mont_deinit(key->montq);
+	free(key);
+}
+
+/**
+ * Recombine m1 = c^dp mod p and m2 = c^dq mod q into result = c^d mod n with Garner's
+ * formula result = m2 + q * (qinv * (m1 - m2) mod p). m1 is destroyed.
+ */
+void combine(bignum* m1, bignum* m2, privateKey* key, bignum* result) {
+	bignum* h = bignum_push();
+	bignum_remainder(m2, key->p, h);
+	if(bignum_less(m1, h)) bignum_iadd(m1, key->p); /* Keep m1 - m2 non-negative */
+	bignum_isubtract(m1, h);
+	bignum_multiply(h, m1, key->qinv);
+	bignum_imodulate(h, key->p);
+	bignum_multiply(result, h, key->q);
+	bignum_iadd(result, m2);
+	bignum_pop(1);
+}
+
+/**
+ * Decode cryptogram c using the private key, result = c^d mod n. Rather than one
+ * exponentiation mod n this does two half size exponentiations, m1 = c^dp mod p and
+ * m2 = c^dq mod q, and recombines them, see combine.
+ */
+void decode(bignum* c, privateKey* key, bignum* result) {
+	bignum *m1 = bignum_push(), *m2 = bignum_push();
+	bignum_mont_modpow(key->montp, c, key->dp, m1);
+	bignum_mont_modpow(key->montq, c, key->dq, m2);
+	combine(m1, m2, key, result);
+	bignum_pop(2);
+}
+
+/**
+ * Take the next block for worker id of the pool, stealing the back half of the largest
+ * remaining range when its own range is empty. Returns -1 once every block is taken.
+ */
+int takeBlock(blockPool* pool, int id) {
+	blockRange *own = &pool->ranges[id], *victim;
+	int i, block = -1, most, end;
+	pthread_mutex_lock(&own->lock);
+	if(own->next < own->end) block = own->next++;
+	pthread_mutex_unlock(&own->lock);
+	while(block < 0) {
+		victim = NULL;
+		most = 0;
+		for(i = 0; i < pool->threads; i++) {
+			pthread_mutex_lock(&pool->ranges[i].lock);
+			if(pool->ranges[i].end - pool->ranges[i].next > most) {
+				most = pool->ranges[i].end - pool->ranges[i].next;
+				victim = &pool->ranges[i];
+			}
+			pthread_mutex_unlock(&pool->ranges[i].lock);
+		}
+		if(victim == NULL) return -1;
+		pthread_mutex_lock(&victim->lock);
+		end = victim->end;
+		if(victim->next < end) {
+			/* A single remaining block is stolen whole */
+			block = victim->next + (end - victim->next) / 2;
+			victim->end = block;
+		}
+		pthread_mutex_unlock(&victim->lock);
+		if(block >= 0) {
+			pthread_mutex_lock(&own->lock);
+			own->next = block + 1;
+			own->end = end;
+			pthread_mutex_unlock(&own->lock);
+		}
+	}
+	return block;
+}
+
+/**
+ * Run blocks of the pool as the given worker until none are left.
+ */
+void runBlocks(blockWorker* worker) {
+	int block;
+	while((block = takeBlock(worker->pool, worker->id)) >= 0) {
+		worker->pool->work(worker->pool->context, block);
+	}
+}
+
+/**
+ * Thread body for the workers of the block pool. Each waits for a new round, runs blocks
+ * if it takes part in it, and goes back to waiting. The workers never exit, so their
+ * scratch stacks stay warm from one round to the next.
+ */
+void* blockThread(void* arg) {
+	blockWorker* worker = arg;
+	blockPool* pool = worker->pool;
+	pthread_mutex_lock(&pool->lock);
+	while(1) {
+		while(pool->round == worker->round) pthread_cond_wait(&pool->wake, &pool->lock);
+		worker->round = pool->round;
+		if(worker->id >= pool->threads) continue;
+		pthread_mutex_unlock(&pool->lock);
+		runBlocks(worker);
+		pthread_mutex_lock(&pool->lock);
+		if(--pool->busy == 0) pthread_cond_signal(&pool->done);
+	}
+	return NULL;
+}
+
+/**
+ * Start workers until the pool has count of them, growing its ranges to match. Called
+ * between rounds with pool->calls held, when no range lock is in use, so the locks can
+ * be moved along with the ranges. Returns how many workers are running, which falls
+ * short if a thread could not be created.
+ */
+int growBlockPool(blockPool* pool, int count) {
+	blockWorker* worker;
+	pthread_t id;
+	int i;
+	if(count <= pool->started) return pool->started;
+	if(pool->ranges != NULL) {
+		for(i = 0; i <= pool->started; i++) pthread_mutex_destroy(&pool->ranges[i].lock);
+	}
+	pool->ranges = realloc(pool->ranges, (count + 1) * sizeof(blockRange));
+	for(i = 0; i <= pool->started; i++) pthread_mutex_init(&pool->ranges[i].lock, NULL);
+	while(pool->started < count) {
+		worker = malloc(sizeof(blockWorker));
+		worker->pool = pool;
+		worker->id = pool->started + 1;
+		worker->round = pool->round;
+		pthread_mutex_init(&pool->ranges[worker->id].lock, NULL);
+		if(pthread_create(&id, NULL, blockThread, worker) != 0) {
+			pthread_mutex_destroy(&pool->ranges[worker->id].lock);
+			free(worker);
+			break;
+		}
+		pthread_detach(id);
+		pool->started++;
+	}
+	return pool->started;
+}
+
+/**
+ * Call work(context, block) for every block in [0, blocks), spread over threadCount threads
+ * (the calling thread included) from the block pool, which starts on the first call. Each
+ * thread starts on an equal share of the range and steals from the others when it runs
+ * out, so slow blocks do not hold up the batch. Returns once every block is done. Calls
+ * from several threads take turns, and work must not call parallelBlocks itself.
+ */
+void parallelBlocks(int blocks, void (*work)(void* context, int block), void* context) {
+	blockPool* pool = &blockWorkers;
+	blockWorker caller;
+	int i, threads = MAX(1, MIN(workerThreads(), blocks));
+	if(threads > 1) {
+		pthread_mutex_lock(&pool->calls);
+		threads = MIN(threads, growBlockPool(pool, threads - 1) + 1);
+		if(threads == 1) pthread_mutex_unlock(&pool->calls);
+	}
+	if(threads == 1) {
+		for(i = 0; i < blocks; i++) work(context, i);
+		return;
+	}
+	pthread_mutex_lock(&pool->lock);
+	pool->threads = threads;
+	pool->work = work;
+	pool->context = context;
+	for(i = 0; i < threads; i++) {
+		pool->ranges[i].next = (int)((long long)blocks * i / threads);
+		pool->ranges[i].end = (int)((long long)blocks * (i + 1) / threads);
+	}
+	pool->busy = threads - 1;
+	pool->round++;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+	caller.pool = pool;
+	caller.id = 0;
+	runBlocks(&caller);
+	pthread_mutex_lock(&pool->lock);
+	while(pool->busy > 0) pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+	pthread_mutex_unlock(&pool->calls);
+}
+
+/**
+ * Run work over the first count blocks of the job in groups of job->lanes blocks, as
+ * many as the batched exponentiation does at once. The groups run in parallel.
+ */
+void batchBlocks(messageJob* job, int count, void (*work)(void* context, int group)) {
+	job->count = count;
+	parallelBlocks((count + job->lanes - 1) / job->lanes, work, job);
+}
+
+/**
+ * Encrypt one group of blocks for encryptStream, see batchBlocks. The "bytes" characters
+ * of each block are packed packBits at a time as m = (m1 + m2*2^packBits +
+ * m3*2^(2*packBits) + ..), see bignum_frombytes, and encoded = m^exponent mod modulus
+ * for the whole group at once by bignum_batch_modpow.
+ */
+void encodeBlocks(void* context, int group) {
+	messageJob* job = context;
+	bignum *x[BATCH_LANES], *results[BATCH_LANES];
+	int i, first = group * job->lanes, count = MIN(job->lanes, job->count - first);
+	STATS_BLOCK_START();
+	for(i = 0; i < count; i++) {
+		x[i] = bignum_push();
+		bignum_frombytes(x[i], job->message + (size_t)(first + i) * job->bytes, job->bytes, packBits);
+		results[i] = &job->blocks[first + i];
+	}
+	bignum_batch_modpow(job->batch, x, job->exponent, results, count);
+	bignum_pop(count);
+	STATS_BLOCK_END(STAT_ENCODE, count);
+}
+
+/**
+ * Decrypt one group of blocks for decryptStream, see batchBlocks, unpacking each into
+ * "bytes" characters. The exponentiations modulo p and q run on the whole group at once.
+ */
+void decodeBlocks(void* context, int group) {
+	messageJob* job = context;
+	bignum *c[BATCH_LANES], *m1[BATCH_LANES], *m2[BATCH_LANES], *x = bignum_push();
+	int i, first = group * job->lanes, count = MIN(job->lanes, job->count - first);
+	STATS_BLOCK_START();
+	for(i = 0; i < count; i++) {
+		c[i] = &job->blocks[first + i];
+		m1[i] = bignum_push();
+		m2[i] = bignum_push();
+	}
+	bignum_batch_modpow(job->key->batchp, c, job->key->dp, m1, count);
+	bignum_batch_modpow(job->key->batchq, c, job->key->dq, m2, count);
+	for(i = 0; i < count; i++) {
+		combine(m1[i], m2[i], job->key, x);
+		bignum_tobytes(x, job->decoded + (size_t)(first + i) * job->bytes, job->bytes, packBits);
+	}
+	bignum_pop(2 * count + 1);
+	STATS_BLOCK_END(STAT_DECODE, count);
+}
+
+/**
+ * Read up to len bytes from in, only coming back short at end of file or on an error. A
+ * single fread on a pipe or terminal can return less than there is to come.
+ */
+size_t readFully(FILE* in, unsigned char* buffer, size_t len) {
+	size_t total = 0, r;
+	while(total < len && (r = fread(buffer + total, 1, len - total, in)) > 0) total += r;
+	return total;
+}
+
+/**
+ * Read the next whitespace separated token from in into token, which has room for max
+ * characters and the terminator. Returns its length, 0 at end of file, or -1 if it is not
+ * a decimal number or is longer than max.
+ */
+int readToken(FILE* in, char* token, int max) {
+	int c, len = 0;
+	while((c = getc(in)) != EOF && isspace(c));
+	while(c != EOF && !isspace(c)) {
+		if(!isdigit(c) || len == max) return -1;
+		token[len++] = (char)c;
+		c = getc(in);
+	}
+	token[len] = '\0';
+	return len;
+}
+
+/**
+ * Store value in the len bytes at out, most significant first.
+ */
+void writeBigEndian(unsigned char* out, unsigned long long value, int len) {
+	while(len-- > 0) {
+		out[len] = (unsigned char)value;
+		value >>= 8;
+	}
 }
 
 /**
- * Perform an in place divide of source, also producing a remainder.
- * source = source/div and remainder = source - source/div.
+ * Load the len bytes at in, most significant first.
  */
-void bignum_idivider(bignum* source, bignum* div, bignum* remainder) {
-	bignum *q = bignum_init(), *r = bignum_init();
-	bignum_divide(q, r, source, div);
-	bignum_copy(q, source);
-	bignum_copy(r, remainder);
-	bignum_deinit(q);
-	bignum_deinit(r);
+unsigned long long readBigEndian(unsigned char* in, int len) {
+	unsigned long long value = 0;
+	int i;
+	for(i = 0; i < len; i++) value = value << 8 | in[i];
+	return value;
 }
 
 /**
- * Calculate the remainder when source is divided by div.
+ * Reverse the order of len bytes in place, between the least significant first order of
+ * bignum_frombytes and bignum_tobytes and the most significant first order of the binary
+ * cryptogram.
  */
-void bignum_remainder(bignum* source, bignum *div, bignum* remainder) {
-	bignum *q = bignum_init();
-	bignum_divide(q, remainder, source, div);
-	bignum_deinit(q);
+void reverseBytes(unsigned char* bytes, int len) {
+	unsigned char t;
+	int i;
+	for(i = 0; i < len / 2; i++) {
+		t = bytes[i];
+		bytes[i] = bytes[len - 1 - i];
+		bytes[len - 1 - i] = t;
+	}
 }
 
 /**
- * Modulate the source by the modulus. source = source % modulus
+ * Fill in the header of a binary cryptogram: CIPHER_MAGIC, then CIPHER_VERSION and the
+ * block width in bytes as 4 byte numbers and the block count and plaintext length as 8
+ * byte numbers, all most significant byte first.
  */
-void bignum_imodulate(bignum* source, bignum* modulus) {
-	bignum *q = bignum_init(), *r = bignum_init();
-	bignum_divide(q, r, source, modulus);
-	bignum_copy(r, source);
-	bignum_deinit(q);
-	bignum_deinit(r);
+void writeCipherHeader(unsigned char* header, int width, long long blocks, long long length) {
+	memcpy(header, CIPHER_MAGIC, 4);
+	writeBigEndian(header + 4, CIPHER_VERSION, 4);
+	writeBigEndian(header + 8, width, 4);
+	writeBigEndian(header + 12, blocks, 8);
+	writeBigEndian(header + 20, length, 8);
 }
 
 /**
- * Divide two bignums by naive long division, producing both a quotient and remainder.
- * quotient = floor(b1/b2), remainder = b1 - quotient * b2. If b1 < b2 the quotient is
- * trivially 0 and remainder is b2. 
+ * Encrypt everything read from in to out with the public key (exponent, modulus), "bytes"
+ * bytes per block as in encodeBlocks. The input is read STREAM_BLOCKS blocks at a time into
+ * buffers that are reused for the whole stream, so memory use does not depend on its
+ * length. Returns the plaintext length.
+ *
+ * With cipherFormat CIPHER_DECIMAL the blocks are written in decimal separated by spaces,
+ * followed by the length of the plaintext since the last block is padded with zeros. With
+ * CIPHER_BINARY a header (see writeCipherHeader) is followed by the blocks as fixed width
+ * numbers of as many bytes as the modulus, most significant byte first, each batch in a
+ * single write. The header needs the block count and length up front, so either in has to
+ * be a file whose size can be measured or out one that can be rewound to fill them in
+ * afterwards, otherwise nothing is written and -1 is returned.
  */
-void bignum_divide(bignum* quotient, bignum* remainder, bignum* b1, bignum* b2) {
-	bignum *b2copy = bignum_init(), *b1copy = bignum_init();
-	bignum *temp = bignum_init(), *temp2 = bignum_init(), *temp3 = bignum_init();
-	bignum* quottemp = bignum_init();
-	word carry = 0;
-	int n, m, i, j, length = 0;
-	unsigned long long factor = 1;
-	unsigned long long gquot, gtemp, grem;
-	if(bignum_less(b1, b2)) { /* Trivial case, b1/b2 = 0 iff b1 < b2. */
-		quotient->length = 0;
-		bignum_copy(b1, remainder);
-	}
-	else if(bignum_iszero(b1)) { /* 0/x = 0.. assuming b2 is nonzero */
-		quotient->length = 0;
-		bignum_fromint(remainder, 0);
-	}
-	else if(b2->length == 1) { /* Division by a single limb means we can do simple division */
-		if(quotient->capacity < b1->length) {
-			quotient->capacity = b1->length;
-			quotient->data = realloc(quotient->data, quotient->capacity * sizeof(word));
-		}
-		for(i = b1->length - 1; i >= 0; i--) {
-			gtemp = carry * RADIX + b1->data[i];
-			gquot = gtemp / b2->data[0];
-			quotient->data[i] = gquot;
-			if(quotient->data[i] != 0 && length == 0) length = i + 1;
-			carry = gtemp % b2->data[0];
+long long encryptStream(FILE* in, FILE* out, int bytes, bignum* exponent, bignum* modulus) {
+	size_t chunk = (size_t)STREAM_BLOCKS * bytes, r;
+	int i, count, width = (bignum_bitlength(modulus) + 7) / 8;
+	long long total = 0, size = -1, start = -1, position;
+	unsigned char header[CIPHER_HEADER], *buffer, *packed = NULL;
+	char* digits = NULL;
+	messageJob job;
+	if(cipherFormat == CIPHER_BINARY) {
+		/* Measure what is left of the input, when it is a file */
+		position = ftell(in);
+		if(position >= 0 && fseek(in, 0, SEEK_END) == 0) {
+			size = ftell(in) - position;
+			fseek(in, position, SEEK_SET);
 		}
-		bignum_fromint(remainder, carry);
-		quotient->length = length;
+		start = ftell(out);
+		if(size < 0 && start < 0) return -1;
+		writeCipherHeader(header, width, size < 0 ? 0 : (size + bytes - 1) / bytes, size < 0 ? 0 : size);
+		fwrite(header, 1, CIPHER_HEADER, out);
+		packed = malloc((size_t)STREAM_BLOCKS * width);
 	}
-	else { /* Long division is neccessary */
-		n = b1->length + 1;
-		m = b2->length;
-		if(quotient->capacity < n - m) {
-			quotient->capacity = n - m;
-			quotient->data = realloc(quotient->data, (n - m) * sizeof(word));
-		}
-		bignum_copy(b1, b1copy);
-		bignum_copy(b2, b2copy);
-		/* Normalize.. multiply by the divisor by 2 until MSB >= HALFRADIX. This ensures fast
-		 * convergence when guessing the quotient below. We also multiply the dividend by the
-		 * same amount to ensure the result does not change. */
-		while(b2copy->data[b2copy->length - 1] < HALFRADIX) {
-			factor *= 2;
-			bignum_imultiply(b2copy, &NUMS[2]);
-		}
-		if(factor > 1) {
-			bignum_fromint(temp, factor);
-			bignum_imultiply(b1copy, temp);
-		}
-		/* Ensure the dividend is longer than the original (pre-normalized) divisor. If it is not
-		 * we introduce a dummy zero word to artificially inflate it. */
-		if(b1copy->length != n) {
-			b1copy->length++;
-			if(b1copy->length > b1copy->capacity) {
-				b1copy->capacity = b1copy->length;
-				b1copy->data = realloc(b1copy->data, b1copy->capacity * sizeof(word));
+	else digits = malloc(bignum_decimalsize(modulus) + 1);
+	buffer = malloc(chunk);
+	job.bytes = bytes;
+	job.message = buffer;
+	job.exponent = exponent;
+	job.mont = bignum_mont_init(modulus);
+	job.batch = bignum_batch_init(job.mont);
+	job.lanes = job.batch->lanes;
+	job.blocks = calloc(STREAM_BLOCKS, sizeof(bignum)); /* Capacity 0, grown on first use */
+	do {
+		r = readFully(in, buffer, chunk);
+		total += r;
+		count = (int)((r + bytes - 1) / bytes);
+		memset(buffer + r, 0, (size_t)count * bytes - r);
+		batchBlocks(&job, count, encodeBlocks);
+		if(cipherFormat == CIPHER_BINARY) {
+			for(i = 0; i < count; i++) {
+				bignum_tobytes(&job.blocks[i], packed + (size_t)i * width, width, 8);
+				reverseBytes(packed + (size_t)i * width, width);
 			}
-			b1copy->data[n - 1] = 0;
+			fwrite(packed, width, count, out);
 		}
-		
-		/* Process quotient by long division */
-		for(i = n - m - 1; i >= 0; i--) {
-			gtemp = RADIX * b1copy->data[i + m] + b1copy->data[i + m - 1];
-			gquot = gtemp / b2copy->data[m - 1];
-			if(gquot >= RADIX) gquot = UINT_MAX;
-			grem = gtemp % b2copy->data[m - 1];
-			while(grem < RADIX && gquot * b2copy->data[m - 2] > RADIX * grem + b1copy->data[i + m - 2]) { /* Should not overflow... ? */
-				gquot--;
-				grem += b2copy->data[m - 1];
-			}
-			quottemp->data[0] = gquot % RADIX;
-			quottemp->data[1] = (gquot / RADIX);
-			if(quottemp->data[1] != 0) quottemp->length = 2;
-			else quottemp->length = 1;
-			bignum_multiply(temp2, b2copy, quottemp);
-			if(m + 1 > temp3->capacity) {
-				temp3->capacity = m + 1;
-				temp3->data = realloc(temp3->data, temp3->capacity * sizeof(word));
-			}
-			temp3->length = 0;
-			for(j = 0; j <= m; j++) {
-				temp3->data[j] = b1copy->data[i + j];
-				if(temp3->data[j] != 0) temp3->length = j + 1;
-			}
-			if(bignum_less(temp3, temp2)) {
-				bignum_iadd(temp3, b2copy);
-				gquot--;
+		else {
+			for(i = 0; i < count; i++) {
+				bignum_tostring(&job.blocks[i], digits);
+				fputs(digits, out);
+				fputc(' ', out);
 			}
-			bignum_isubtract(temp3, temp2);
-			for(j = 0; j < temp3->length; j++) b1copy->data[i + j] = temp3->data[j];
-			for(j = temp3->length; j <= m; j++) b1copy->data[i + j] = 0;
-			quotient->data[i] = gquot;
-			if(quotient->data[i] != 0) quotient->length = i;
 		}
-		
-		if(quotient->data[b1->length - b2->length] == 0) quotient->length = b1->length - b2->length;
-		else quotient->length = b1->length - b2->length + 1;
-		
-		/* Divide by factor now to find final remainder */
-		carry = 0;
-		for(i = b1copy->length - 1; i >= 0; i--) {
-			gtemp = carry * RADIX + b1copy->data[i];
-			b1copy->data[i] = gtemp/factor;
-			if(b1copy->data[i] != 0 && length == 0) length = i + 1;
-			carry = gtemp % factor;
+	}
+	while(r == chunk);
+	if(cipherFormat == CIPHER_BINARY && total != size) {
+		/* The input could not be measured or changed size while it was read */
+		if(start >= 0 && fseek(out, start, SEEK_SET) == 0) {
+			writeCipherHeader(header, width, (total + bytes - 1) / bytes, total);
+			fwrite(header, 1, CIPHER_HEADER, out);
+			fseek(out, 0, SEEK_END);
 		}
-		b1copy->length = length;
-		bignum_copy(b1copy, remainder);
+		else total = -1;
 	}
-	bignum_deinit(temp);
-	bignum_deinit(temp2);
-	bignum_deinit(temp3);
-	bignum_deinit(b1copy);
-	bignum_deinit(b2copy);
-	bignum_deinit(quottemp);
+	else if(cipherFormat == CIPHER_DECIMAL) fprintf(out, "%lld", total);
+	for(i = 0; i < STREAM_BLOCKS; i++) free(job.blocks[i].data);
+	free(job.blocks);
+	bignum_batch_deinit(job.batch);
+	bignum_mont_deinit(job.mont);
+	free(digits);
+	free(packed);
+	free(buffer);
+	return total;
 }
 
 /**
- * Perform modular exponentiation by repeated squaring. This will compute
- * result = base^exponent mod modulus
+ * Decrypt the decimal cryptogram of encryptStream. Blocks are decrypted STREAM_BLOCKS at a
+ * time as they are read. A full batch is only written out once a block after it has been
+ * seen, so that the padding of the last block can be cut off at the length at the end.
  */
-void bignum_modpow(bignum* base, bignum* exponent, bignum* modulus, bignum* result) {
-	bignum *a = bignum_init(), *b = bignum_init(), *c = bignum_init();
-	bignum *discard = bignum_init(), *remainder = bignum_init();
-	bignum_copy(base, a);
-	bignum_copy(exponent, b);
-	bignum_copy(modulus, c);
-	bignum_fromint(result, 1);
-	while(bignum_greater(b, &NUMS[0])) {
-		if(b->data[0] & 1) {
-			bignum_imultiply(result, a);
-			bignum_imodulate(result, c);
+long long decryptDecimal(FILE* in, FILE* out, int bytes, privateKey* key) {
+	int max = MAX(bignum_decimalsize(key->n), 20), count = 0, i, r;
+	char *token = malloc(max + 1), *next = malloc(max + 1), *swap;
+	long long total = 0, length;
+	messageJob job;
+	job.bytes = bytes;
+	job.key = key;
+	job.lanes = key->batchp->lanes;
+	job.blocks = calloc(STREAM_BLOCKS, sizeof(bignum));
+	job.decoded = malloc((size_t)STREAM_BLOCKS * bytes);
+	r = readToken(in, token, max);
+	while(r > 0) {
+		r = readToken(in, next, max);
+		if(r <= 0) break;
+		/* Another token follows, so token is a block and the batch before it is complete */
+		if(count == STREAM_BLOCKS) {
+			batchBlocks(&job, count, decodeBlocks);
+			fwrite(job.decoded, 1, (size_t)count * bytes, out);
+			total += (long long)count * bytes;
+			count = 0;
 		}
-		bignum_idivide(b, &NUMS[2]);
-		bignum_copy(a, discard);
-		bignum_imultiply(a, discard);
-		bignum_imodulate(a, c);
+		bignum_fromstring(&job.blocks[count++], token);
+		swap = token;
+		token = next;
+		next = swap;
+	}
+	length = r < 0 || token[0] == '\0' ? -1 : strtoll(token, NULL, 10);
+	/* The length has to end inside the last block */
+	if(length < 0 || length > total + (long long)count * bytes || (count > 0 && length <= total + (long long)(count - 1) * bytes)) {
+		length = -1;
+	}
+	else {
+		batchBlocks(&job, count, decodeBlocks);
+		fwrite(job.decoded, 1, (size_t)(length - total), out);
 	}
-	bignum_deinit(a);
-	bignum_deinit(b);
-	bignum_deinit(c);
-	bignum_deinit(discard);
-	bignum_deinit(remainder);
+	for(i = 0; i < STREAM_BLOCKS; i++) free(job.blocks[i].data);
+	free(job.blocks);
+	free(job.decoded);
+	free(token);
+	free(next);
+	return length;
 }
 
 /**
- * Compute the gcd of two bignums. result = gcd(b1, b2)
+ * Decrypt the binary cryptogram of encryptStream, after its magic. The header gives the
+ * block count and plaintext length up front, so each batch of STREAM_BLOCKS blocks is read
+ * in one go and written out as soon as it is decrypted.
  */
-void bignum_gcd(bignum* b1, bignum* b2, bignum* result) {
-	bignum *a = bignum_init(), *b = bignum_init(), *remainder = bignum_init();
-	bignum *temp = bignum_init(), *discard = bignum_init();
-	bignum_copy(b1, a);
-	bignum_copy(b2, b);
-	while(!bignum_equal(b, &NUMS[0])) {
-		bignum_copy(b, temp);
-		bignum_imodulate(a, b);
-		bignum_copy(a, b);
-		bignum_copy(temp, a);
+long long decryptBinary(FILE* in, FILE* out, int bytes, privateKey* key) {
+	int width = (bignum_bitlength(key->n) + 7) / 8, count, i;
+	unsigned char header[CIPHER_HEADER], *packed;
+	long long blocks, length, done;
+	messageJob job;
+	if(readFully(in, header + 4, CIPHER_HEADER - 4) != CIPHER_HEADER - 4) return -1;
+	blocks = (long long)readBigEndian(header + 12, 8);
+	length = (long long)readBigEndian(header + 20, 8);
+	if(readBigEndian(header + 4, 4) != CIPHER_VERSION || readBigEndian(header + 8, 4) != (unsigned long long)width) return -1;
+	if(length < 0 || blocks != (length + bytes - 1) / bytes) return -1;
+	packed = malloc((size_t)STREAM_BLOCKS * width);
+	job.bytes = bytes;
+	job.key = key;
+	job.lanes = key->batchp->lanes;
+	job.blocks = calloc(STREAM_BLOCKS, sizeof(bignum));
+	job.decoded = malloc((size_t)STREAM_BLOCKS * bytes);
+	for(done = 0; done < blocks; done += count) {
+		count = (int)MIN(blocks - done, STREAM_BLOCKS);
+		if(readFully(in, packed, (size_t)count * width) != (size_t)count * width) {
+			length = -1;
+			break;
+		}
+		for(i = 0; i < count; i++) {
+			reverseBytes(packed + (size_t)i * width, width);
+			bignum_frombytes(&job.blocks[i], packed + (size_t)i * width, width, 8);
+		}
+		batchBlocks(&job, count, decodeBlocks);
+		fwrite(job.decoded, 1, (size_t)MIN((long long)count * bytes, length - done * bytes), out);
 	}
-	bignum_copy(a, result);
-	bignum_deinit(a);
-	bignum_deinit(b);
-	bignum_deinit(remainder);
-	bignum_deinit(temp);
-	bignum_deinit(discard);
+	for(i = 0; i < STREAM_BLOCKS; i++) free(job.blocks[i].data);
+	free(job.blocks);
+	free(job.decoded);
+	free(packed);
+	return length;
 }
 
 /**
- * Compute the inverse of a mod m. Or, result = a^-1 mod m.
+ * Decrypt a cryptogram written by encryptStream, in either format, from in to out with the
+ * private key, using the same number of bytes per block. Returns the length of the
+ * plaintext, or -1 if the stream is not in a format encryptStream writes.
  */
-void bignum_inverse(bignum* a, bignum* m, bignum* result) {
-	bignum *remprev = bignum_init(), *rem = bignum_init();
-	bignum *auxprev = bignum_init(), *aux = bignum_init();
-	bignum *rcur = bignum_init(), *qcur = bignum_init(), *acur = bignum_init();
-	
-	bignum_copy(m, remprev);
-	bignum_copy(a, rem);
-	bignum_fromint(auxprev, 0);
-	bignum_fromint(aux, 1);
-	while(bignum_greater(rem, &NUMS[1])) {
-		bignum_divide(qcur, rcur, remprev, rem);
-		/* Observe we are finding the inverse in a finite field so we can use
-		 * a modified algorithm that avoids negative numbers here */
-		bignum_subtract(acur, m, qcur);
-		bignum_imultiply(acur, aux);
-		bignum_iadd(acur, auxprev);
-		bignum_imodulate(acur, m);
-		
-		bignum_copy(rem, remprev);
-		bignum_copy(aux, auxprev);
-		bignum_copy(rcur, rem);
-		bignum_copy(acur, aux);
+long long decryptStream(FILE* in, FILE* out, int bytes, privateKey* key) {
+	unsigned char magic[4];
+	int c = getc(in);
+	if(c != CIPHER_MAGIC[0]) {
+		if(c != EOF) ungetc(c, in);
+		return decryptDecimal(in, out, bytes, key);
 	}
-	
-	bignum_copy(acur, result);
-	
-	bignum_deinit(remprev);
-	bignum_deinit(rem);
-	bignum_deinit(auxprev);
-	bignum_deinit(aux);
-	bignum_deinit(rcur);
-	bignum_deinit(qcur);
-	bignum_deinit(acur);
+	magic[0] = (unsigned char)c;
+	if(readFully(in, magic + 1, 3) != 3 || memcmp(magic, CIPHER_MAGIC, 4) != 0) return -1;
+	return decryptBinary(in, out, bytes, key);
 }
 
 /**
- * Compute the jacobi symbol, J(ac, nc).
+ * Write a key file to path with the given permissions (0600 for a private key), which are
+ * also set on a file that is already there, with the magic line and then the count named
+ * values. Returns 0 if it could not be written.
  */
-int bignum_jacobi(bignum* ac, bignum* nc) {
-	bignum *remainder = bignum_init(), *twos = bignum_init();
-	bignum *temp = bignum_init(), *a = bignum_init(), *n = bignum_init();
-	int mult = 1, result = 0;
-	bignum_copy(ac, a);
-	bignum_copy(nc, n);
-	while(bignum_greater(a, &NUMS[1]) && !bignum_equal(a, n)) {
-		bignum_imodulate(a, n);
-		if(bignum_leq(a, &NUMS[1]) || bignum_equal(a, n)) break;
-		bignum_fromint(twos, 0);
-		/* Factor out multiples of two */
-		while(a->data[0] % 2 == 0) {
-			bignum_iadd(twos, &NUMS[1]);
-			bignum_idivide(a, &NUMS[2]);
-		}
-		/* Coefficient for flipping */
-		if(bignum_greater(twos, &NUMS[0]) && twos->data[0] % 2 == 1) {
-			bignum_remainder(n, &NUMS[8], remainder);
-			if(!bignum_equal(remainder, &NUMS[1]) && !bignum_equal(remainder, &NUMS[7])) {
-				mult *= -1;
+int writeKey(char* path, int mode, char* magic, char** names, bignum** values, int count) {
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, mode), i, ok;
+	char* digits;
+	FILE* out;
+	if(fd < 0) return 0;
+	if(fchmod(fd, mode) != 0 || (out = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		return 0;
+	}
+	fprintf(out, "%s %d\n", magic, KEY_VERSION);
+	for(i = 0; i < count; i++) {
+		digits = malloc(bignum_decimalsize(values[i]) + 1);
+		bignum_tostring(values[i], digits);
+		fprintf(out, "%s %s\n", names[i], digits);
+		free(digits);
+	}
+	ok = !ferror(out);
+	return fclose(out) == 0 && ok;
+}
+
+/**
+ * Read the count named values from a key file written by writeKey. Values that were not
+ * asked for are skipped, so a private key file, which holds the public exponent as well,
+ * also serves as a public one. Returns 0 if the file cannot be read, is not a key file or
+ * lacks one of the values.
+ */
+int readKey(char* path, char** names, bignum** values, int count) {
+	FILE* in = fopen(path, "r");
+	char magic[32], name[16], *digits;
+	int version, i, found = 0, ok = 1;
+	if(in == NULL) return 0;
+	if(fscanf(in, "%31s %d", magic, &version) != 2 || version != KEY_VERSION
+		|| (strcmp(magic, KEY_PUBLIC) != 0 && strcmp(magic, KEY_PRIVATE) != 0)) {
+		fclose(in);
+		return 0;
+	}
+	digits = malloc(KEY_DIGITS + 1);
+	while(ok && fscanf(in, "%15s", name) == 1) {
+		if(readToken(in, digits, KEY_DIGITS) <= 0) ok = 0;
+		for(i = 0; ok && i < count; i++) {
+			if(strcmp(name, names[i]) == 0) {
+				bignum_fromstring(values[i], digits);
+				found |= 1 << i;
 			}
 		}
-		if(bignum_leq(a, &NUMS[1]) || bignum_equal(a, n)) break;
-		bignum_remainder(n, &NUMS[4], remainder);
-		bignum_remainder(a, &NUMS[4], temp);
-		if(!bignum_equal(remainder, &NUMS[1]) && !bignum_equal(temp, &NUMS[1])) mult *= -1;
-		bignum_copy(a, temp);
-		bignum_copy(n, a);
-		bignum_copy(temp, n);
-	}
-	if(bignum_equal(a, &NUMS[1])) result = mult;
-	else result = 0;
-	bignum_deinit(remainder);
-	bignum_deinit(twos);
-	bignum_deinit(temp);
-	bignum_deinit(a);
-	bignum_deinit(n);
-	return result;
+	}
+	free(digits);
+	fclose(in);
+	return ok && found == (1 << count) - 1;
 }
 
 /**
- * Check whether a is a Euler witness for n. That is, if a^(n - 1)/2 != Ja(a, n) mod n
+ * Generate a key pair with a modulus n of exactly the given number of bits (at least 4),
+ * from primes p and q of half as many with their top two bits set, searched for at the
+ * same time. Keys of the standard sizes then get the fixed width exponentiation for n and
+ * for p and q. e is a random public exponent and d the private one.
  */
-int solovayPrime(int a, bignum* n) {
-	bignum *ab = bignum_init(), *res = bignum_init(), *pow = bignum_init();
-	bignum *modpow = bignum_init();
-	int x, result;
-
-	bignum_fromint(ab, a);
-	x = bignum_jacobi(ab, n);
-	if(x == -1) bignum_subtract(res, n, &NUMS[1]);
-	else bignum_fromint(res, x);
-	bignum_copy(n, pow);
-	bignum_isubtract(pow, &NUMS[1]);
-	bignum_idivide(pow, &NUMS[2]);
-	bignum_modpow(ab, pow, n, modpow);
-	
-	result = !bignum_equal(res, &NUMS[0]) && bignum_equal(modpow, res);
-	bignum_deinit(ab);
-	bignum_deinit(res);
-	bignum_deinit(pow);
-	bignum_deinit(modpow);
-	return result;
+void generateKey(int bits, bignum* n, bignum* e, bignum* d, bignum* p, bignum* q) {
+	bignum *phi = bignum_init(), *temp1 = bignum_init(), *temp2 = bignum_init();
+	bignum *primes[2], *starts[2];
+	primes[0] = p;
+	primes[1] = q;
+	starts[0] = temp1;
+	starts[1] = temp2;
+	STATS_PHASE_START();
+	do {
+		/* A search that runs past the top of its size, which is all but impossible, starts over */
+		randBitsCandidate((bits + 1) / 2, starts[0]);
+		randBitsCandidate(bits / 2, starts[1]);
+		searchPrimes(2, starts, primes, NULL, NULL);
+	}
+	while(bignum_bitlength(p) != (bits + 1) / 2 || bignum_bitlength(q) != bits / 2);
+	STATS_PHASE_END(STAT_PRIMES);
+	STATS_PHASE_START();
+	bignum_multiply(n, p, q);
+	bignum_subtract(temp1, p, &NUMS[1]);
+	bignum_subtract(temp2, q, &NUMS[1]);
+	bignum_multiply(phi, temp1, temp2); /* phi = (p - 1) * (q - 1) */
+	STATS_PHASE_END(STAT_MODULUS);
+	STATS_PHASE_START();
+	randExponent(phi, EXPONENT_MAX, e);
+	STATS_PHASE_END(STAT_EXPONENT);
+	STATS_PHASE_START();
+	bignum_inverse(e, phi, d);
+	STATS_PHASE_END(STAT_PRIVATE);
+	bignum_deinit(phi);
+	bignum_deinit(temp1);
+	bignum_deinit(temp2);
 }
 
+/* The benchmarks include this file directly and provide their own main */
+#ifndef RSA_NO_MAIN
 /**
- * Test if n is probably prime, by repeatedly using the Solovay-Strassen primality test.
+ * Seed rand() from /dev/urandom, or where there is none from the time and process id, so
+ * that keys generated in the same second still differ.
  */
-int probablePrime(bignum* n, int k) {
-	if(bignum_equal(n, &NUMS[2])) return 1;
-	else if(n->data[0] % 2 == 0 || bignum_equal(n, &NUMS[1])) return 0;
-	while(k-- > 0) {
-		if(n->length <= 1) { /* Prevent a > n */
-			if(!solovayPrime(rand() % (n->data[0] - 2) + 2, n)) return 0;
-		}
-		else {
-			int wit = rand() % (RAND_MAX - 2) + 2;
-			if(!solovayPrime(wit, n)) return 0;
-		}
+void seedRandom() {
+	unsigned int seed = (unsigned int)time(NULL) ^ ((unsigned int)getpid() << 16);
+	FILE* f = fopen("/dev/urandom", "rb");
+	if(f != NULL) {
+		if(fread(&seed, sizeof(seed), 1, f) != 1) seed ^= (unsigned int)clock();
+		fclose(f);
 	}
-	return 1;
+	srand(seed);
 }
 
 /**
- * Generate a random prime number, with a specified number of digits.
- * This will generate a base 10 digit string of given length, convert it
- * to a bignum and then do an increasing search for the first probable prime.
+ * Print how the command line is used, returns EXIT_FAILURE for main to pass on.
  */
-void randPrime(int numDigits, bignum* result) {
-	char *string = malloc((numDigits + 1) * sizeof(char));
-	int i;
-	string[0] = (rand() % 9) + '1'; /* No leading zeros */
-	string[numDigits - 1] = (rand() % 5) * 2 + '1'; /* Last digit is odd */
-	for(i = 1; i < numDigits - 1; i++) string[i] = (rand() % 10) + '0';
-	string[numDigits] = '\0';
-	bignum_fromstring(result, string);
-	while(1) {
-		if(probablePrime(result, ACCURACY)) {
-			free(string);
-			return;
-		}
-		bignum_iadd(result, &NUMS[2]); /* result += 2 */
-	}
+int usage(char* program) {
+	fprintf(stderr, "usage: %s                                      demonstration on \"text.txt\"\n", program);
+	fprintf(stderr, "       %s keygen <bits> <public key> <private key>\n", program);
+	fprintf(stderr, "       %s encrypt <public key> [input [output]]\n", program);
+	fprintf(stderr, "       %s decrypt <private key> [input [output]]\n", program);
+	fprintf(stderr, "       %s bench <private key> [blocks]\n", program);
+	fprintf(stderr, "Input and output default to standard input and output, as does \"-\".\n");
+	return EXIT_FAILURE;
 }
 
 /**
- * Choose a random public key exponent for the RSA algorithm. The exponent will
- * be less than the modulus, n, and coprime to phi.
+ * Open the named input or output of a command, or hand back the standard one when there
+ * is no name or it is "-". Complains and returns NULL if the file cannot be opened.
  */
-void randExponent(bignum* phi, int n, bignum* result) {
-	bignum* gcd = bignum_init();
-	int e = rand() % n;
-	while(1) {
-		bignum_fromint(result, e);
-		bignum_gcd(result, phi, gcd);
-		if(bignum_equal(gcd, &NUMS[1])) {
-			bignum_deinit(gcd);
-			return;
-		}
-		e = (e + 1) % n;
-		if(e <= 2) e = 3;
-	}
+FILE* openStream(char* path, char* mode, FILE* standard) {
+	FILE* f;
+	if(path == NULL || strcmp(path, "-") == 0) return standard;
+	if((f = fopen(path, mode)) == NULL) fprintf(stderr, "Failed to open file \"%s\"\n", path);
+	return f;
 }
 
 /**
- * Read the file fd into an array of bytes ready for encryption.
- * The array will be padded with zeros until it divides the number of
- * bytes encrypted per block. Returns the number of bytes read.
+ * Close a stream from openStream, only flushing the standard ones. Returns 0 if there
+ * was a write error.
  */
-int readFile(FILE* fd, char** buffer, int bytes) {
-	int len = 0, cap = BUF_SIZE, r;
-	char buf[BUF_SIZE];
-	*buffer = malloc(BUF_SIZE * sizeof(char));
-	while((r = fread(buf, sizeof(char), BUF_SIZE, fd)) > 0) {
-		if(len + r >= cap) {
-			cap *= 2;
-			*buffer = realloc(*buffer, cap);
-		}
-		memcpy(&(*buffer)[len], buf, r);
-		len += r;
-	}
-	/* Pad the last block with zeros to signal end of cryptogram. An additional block is added if there is no room */
-	if(len + bytes - len % bytes > cap) *buffer = realloc(*buffer, len + bytes - len % bytes);
-	do {
-		(*buffer)[len] = '\0';
-		len++;
+int closeStream(FILE* f, FILE* standard) {
+	int ok = !ferror(f);
+	if(f == standard) return fflush(f) == 0 && ok;
+	return fclose(f) == 0 && ok;
+}
+
+/**
+ * Load the private key in path, NULL (after complaining) if the file is not a private key
+ * or its factors do not give its modulus. e receives the public exponent.
+ */
+privateKey* loadPrivateKey(char* path, bignum* e) {
+	char* names[] = {"n", "e", "d", "p", "q"};
+	bignum *n = bignum_init(), *d = bignum_init(), *p = bignum_init(), *q = bignum_init();
+	bignum* values[5];
+	privateKey* key = NULL;
+	values[0] = n; values[1] = e; values[2] = d; values[3] = p; values[4] = q;
+	if(!readKey(path, names, values, 5)) fprintf(stderr, "Failed to read private key file \"%s\"\n", path);
+	else if(bignum_less(p, &NUMS[3]) || bignum_less(q, &NUMS[3]) || p->data[0] % 2 == 0 || q->data[0] % 2 == 0
+		|| (key = initPrivateKey(p, q, d), !bignum_equal(key->n, n))) {
+		fprintf(stderr, "Private key file \"%s\" is inconsistent\n", path);
+		if(key != NULL) deinitPrivateKey(key);
+		key = NULL;
 	}
-	while(len % bytes != 0);
-	return len;
+	bignum_deinit(n);
+	bignum_deinit(d);
+	bignum_deinit(p);
+	bignum_deinit(q);
+	return key;
 }
 
 /**
- * Encode the message m using public exponent and modulus, result = m^e mod n
+ * keygen <bits> <public key> <private key>: generate a key pair with a modulus of exactly
+ * bits bits and write it to the two files. The private key file is only readable by its
+ * owner.
  */
-void encode(bignum* m, bignum* e, bignum* n, bignum* result) {
-	bignum_modpow(m, e, n, result);
+int keygenCommand(char* program, int argc, char** argv) {
+	char* names[] = {"n", "e", "d", "p", "q"};
+	bignum *n, *e, *d, *p, *q;
+	bignum* values[5];
+	int bits, status = EXIT_SUCCESS;
+	double start;
+	if(argc != 3 || (bits = atoi(argv[0])) < 64) return usage(program);
+	n = bignum_init(); e = bignum_init(); d = bignum_init(); p = bignum_init(); q = bignum_init();
+	values[0] = n; values[1] = e; values[2] = d; values[3] = p; values[4] = q;
+	start = wallSeconds();
+	generateKey(bits, n, e, d, p, q);
+	if(bignum_bitlength(n) != bits) {
+		fprintf(stderr, "Generated a %d bit key instead of %d bits\n", bignum_bitlength(n), bits);
+		status = EXIT_FAILURE;
+	}
+	else if(!writeKey(argv[1], 0644, KEY_PUBLIC, names, values, 2)) {
+		fprintf(stderr, "Failed to write public key file \"%s\"\n", argv[1]);
+		status = EXIT_FAILURE;
+	}
+	else if(!writeKey(argv[2], 0600, KEY_PRIVATE, names, values, 5)) {
+		fprintf(stderr, "Failed to write private key file \"%s\"\n", argv[2]);
+		status = EXIT_FAILURE;
+	}
+	else printf("Generated a %d bit key in %.3f seconds\n", bignum_bitlength(n), wallSeconds() - start);
+	bignum_deinit(n);
+	bignum_deinit(e);
+	bignum_deinit(d);
+	bignum_deinit(p);
+	bignum_deinit(q);
+	return status;
 }
 
 /**
- * Decode cryptogram c using private exponent and public modulus, result = c^d mod n
+ * encrypt <public key> [input [output]]: encrypt input to output with encryptStream. The
+ * binary cryptogram needs its length up front, so when neither end is a file the input is
+ * spooled to a temporary one first.
  */
-void decode(bignum* c, bignum* d, bignum* n, bignum* result) {
-	bignum_modpow(c, d, n, result);
+int encryptCommand(char* program, int argc, char** argv) {
+	char* names[] = {"n", "e"};
+	bignum *n, *e;
+	bignum* values[2];
+	unsigned char buffer[BUF_SIZE];
+	FILE *in = NULL, *out = NULL, *spool = NULL;
+	long long len = -1;
+	size_t r;
+	int status = EXIT_FAILURE, spooled = 1;
+	if(argc < 1 || argc > 3) return usage(program);
+	values[0] = n = bignum_init();
+	values[1] = e = bignum_init();
+	if(!readKey(argv[0], names, values, 2)) fprintf(stderr, "Failed to read key file \"%s\"\n", argv[0]);
+	else if((in = openStream(argc > 1 ? argv[1] : NULL, "rb", stdin)) != NULL
+		&& (out = openStream(argc > 2 ? argv[2] : NULL, "wb", stdout)) != NULL) {
+		if(cipherFormat == CIPHER_BINARY && ftell(in) < 0 && ftell(out) < 0 && (spool = tmpfile()) != NULL) {
+			while((r = fread(buffer, 1, BUF_SIZE, in)) > 0 && fwrite(buffer, 1, r, spool) == r);
+			spooled = r == 0 && !ferror(in) && !ferror(spool) && fflush(spool) == 0;
+			rewind(spool);
+		}
+		if(!spooled) fprintf(stderr, "Failed to copy the input to a temporary file\n");
+		else {
+			STATS_PHASE_START();
+			len = encryptStream(spool != NULL ? spool : in, out, (bignum_bitlength(n) - 1) / packBits, e, n);
+			STATS_PHASE_END(STAT_ENCRYPT);
+			if(len < 0) fprintf(stderr, "Failed to encrypt, the input could not be measured\n");
+		}
+		if(!closeStream(out, stdout)) fprintf(stderr, "Failed to write the cryptogram\n");
+		else if(len >= 0) status = EXIT_SUCCESS;
+		if(spool != NULL) fclose(spool);
+	}
+	if(in != NULL) closeStream(in, stdin);
+	bignum_deinit(n);
+	bignum_deinit(e);
+	return status;
 }
 
 /**
- * Encode the message of given length, using the public key (exponent, modulus)
- * The resulting array will be of size len/bytes, each index being the encryption
- * of "bytes" consecutive characters, given by m = (m1 + m2*128 + m3*128^2 + ..),
- * encoded = m^exponent mod modulus
+ * decrypt <private key> [input [output]]: decrypt a cryptogram of either format from
+ * input to output with decryptStream.
  */
-bignum *encodeMessage(int len, int bytes, char *message, bignum *exponent, bignum *modulus) {
-	/* Calloc works here because capacity = 0 forces a realloc by callees but we should really
-	 * bignum_init() all of these */
-	int i, j;
-	bignum *encoded = calloc(len/bytes, sizeof(bignum));
-	bignum *num128 = bignum_init(), *num128pow = bignum_init();
-	bignum *x = bignum_init(), *current = bignum_init();
-	bignum_fromint(num128, 128);
-	bignum_fromint(num128pow, 1);
-	for(i = 0; i < len; i += bytes) {
-		bignum_fromint(x, 0);
-		bignum_fromint(num128pow, 1);
-		/* Compute buffer[0] + buffer[1]*128 + buffer[2]*128^2 etc (base 128 representation for characters->int encoding)*/
-		for(j = 0; j < bytes; j++) {
-			bignum_fromint(current, message[i + j]);
-			bignum_imultiply(current, num128pow);
-			bignum_iadd(x, current); /*x += buffer[i + j] * (1 << (7 * j)) */
-			bignum_imultiply(num128pow, num128);
-		}
-		encode(x, exponent, modulus, &encoded[i/bytes]);
-#ifndef NOPRINT
-		bignum_print(&encoded[i/bytes]);
-		printf(" ");
-#endif
+int decryptCommand(char* program, int argc, char** argv) {
+	bignum* e;
+	privateKey* key;
+	FILE *in, *out;
+	long long len;
+	int status = EXIT_FAILURE;
+	if(argc < 1 || argc > 3) return usage(program);
+	if((key = loadPrivateKey(argv[0], e = bignum_init())) == NULL) {
+		bignum_deinit(e);
+		return EXIT_FAILURE;
+	}
+	if((in = openStream(argc > 1 ? argv[1] : NULL, "rb", stdin)) != NULL) {
+		if((out = openStream(argc > 2 ? argv[2] : NULL, "wb", stdout)) != NULL) {
+			STATS_PHASE_START();
+			len = decryptStream(in, out, (bignum_bitlength(key->n) - 1) / packBits, key);
+			STATS_PHASE_END(STAT_DECRYPT);
+			if(len < 0) fprintf(stderr, "Cryptogram is malformed!\n");
+			if(!closeStream(out, stdout)) fprintf(stderr, "Failed to write the message\n");
+			else if(len >= 0) status = EXIT_SUCCESS;
+		}
+		closeStream(in, stdin);
 	}
-	return encoded;
+	deinitPrivateKey(key);
+	bignum_deinit(e);
+	return status;
 }
 
 /**
- * Decode the cryptogram of given length, using the private key (exponent, modulus)
- * Each encrypted packet should represent "bytes" characters as per encodeMessage.
- * The returned message will be of size len * bytes.
+ * bench <private key> [blocks]: time encrypting and decrypting that many blocks of random
+ * bytes (BENCH_BLOCKS by default) with the key, through temporary files, and check that
+ * the message comes back. Nothing is reported if either step fails.
  */
-int *decodeMessage(int len, int bytes, bignum *cryptogram, bignum *exponent, bignum *modulus) {
-	int *decoded = malloc(len * bytes * sizeof(int));
-	int i, j;
-	bignum *x = bignum_init(), *remainder = bignum_init();
-	bignum *num128 = bignum_init();
-	bignum_fromint(num128, 128);
-	for(i = 0; i < len; i++) {
-		decode(&cryptogram[i], exponent, modulus, x);
-		for(j = 0; j < bytes; j++) {
-			bignum_idivider(x, num128, remainder);
-			if(remainder->length == 0) decoded[i*bytes + j] = (char)0;
-			else decoded[i*bytes + j] = (char)(remainder->data[0]);
-#ifndef NOPRINT
-			printf("%c", (char)(decoded[i*bytes + j]));
-#endif
+int benchCommand(char* program, int argc, char** argv) {
+	bignum* e;
+	privateKey* key;
+	FILE *plain, *cipher, *decoded;
+	unsigned char *message, *check;
+	int blocks = argc > 1 ? atoi(argv[1]) : BENCH_BLOCKS, bytes, status = EXIT_FAILURE, ok = 0;
+	long long len, i;
+	double start, encrypt, decrypt;
+	if(argc < 1 || argc > 2 || blocks <= 0) return usage(program);
+	if((key = loadPrivateKey(argv[0], e = bignum_init())) == NULL) {
+		bignum_deinit(e);
+		return EXIT_FAILURE;
+	}
+	bytes = (bignum_bitlength(key->n) - 1) / packBits;
+	len = (long long)blocks * bytes;
+	message = malloc(len);
+	check = malloc(len);
+	for(i = 0; i < len; i++) message[i] = rand() & 0xff;
+	plain = tmpfile();
+	cipher = tmpfile();
+	decoded = tmpfile();
+	if(plain == NULL || cipher == NULL || decoded == NULL) fprintf(stderr, "Failed to create temporary files\n");
+	else {
+		fwrite(message, 1, len, plain);
+		rewind(plain);
+		start = wallSeconds();
+		if(encryptStream(plain, cipher, bytes, e, key->n) < 0 || fflush(cipher) != 0) {
+			fprintf(stderr, "Failed to encrypt the message\n");
+		}
+		else {
+			encrypt = wallSeconds() - start;
+			rewind(cipher);
+			start = wallSeconds();
+			if(decryptStream(cipher, decoded, bytes, key) < 0 || fflush(decoded) != 0) {
+				fprintf(stderr, "Failed to decrypt the message\n");
+			}
+			else ok = 1;
+			decrypt = wallSeconds() - start;
+			rewind(decoded);
 		}
 	}
-	return decoded;
+	if(ok) {
+		printf("%d bit key, %d blocks of %d bytes, %d threads\n", bignum_bitlength(key->n), blocks, bytes, workerThreads());
+		printf("Encrypt %10.3f seconds %12.1f blocks/s %10.3f MB/s\n", encrypt, blocks / encrypt, len / encrypt / 1e6);
+		printf("Decrypt %10.3f seconds %12.1f blocks/s %10.3f MB/s\n", decrypt, blocks / decrypt, len / decrypt / 1e6);
+		if(readFully(decoded, check, len) != (size_t)len || memcmp(message, check, len) != 0) {
+			fprintf(stderr, "Decryption did not give back the message\n");
+		}
+		else status = EXIT_SUCCESS;
+	}
+	if(plain != NULL) fclose(plain);
+	if(cipher != NULL) fclose(cipher);
+	if(decoded != NULL) fclose(decoded);
+	free(message);
+	free(check);
+	deinitPrivateKey(key);
+	bignum_deinit(e);
+	return status;
 }
 
 /**
- * Main method to demostrate the system. Sets up primes p, q, and proceeds to encode and
- * decode the message given in "text.txt"
+ * Demonstrate the system, run when no command is given. Sets up primes p, q, and proceeds
+ * to encode and decode the message given in "text.txt", waiting for enter after each step.
  */
-int main(void) {
-	int i, bytes, len;
+int demo(void) {
+	int bytes;
+	long long len;
+	size_t r;
 	bignum *p = bignum_init(), *q = bignum_init(), *n = bignum_init();
 	bignum *phi = bignum_init(), *e = bignum_init(), *d = bignum_init();
-	bignum *bbytes = bignum_init(), *shift = bignum_init();
 	bignum *temp1 = bignum_init(), *temp2 = bignum_init();
+	bignum *primes[2];
+	double seconds[2];
+	long candidates[2];
+	privateKey *key;
 	
-	bignum *encoded;
-	int *decoded;
-	char *buffer;
-	FILE* f;
-	
-	srand(time(NULL));
+	char copy[BUF_SIZE];
+	FILE *f, *cipher;
 	
-	randPrime(FACTOR_DIGITS, p);
+	/* p and q are searched for at the same time */
+	primes[0] = p;
+	primes[1] = q;
+	STATS_PHASE_START();
+	randPrimes(2, FACTOR_DIGITS, primes, seconds, candidates);
+	STATS_PHASE_END(STAT_PRIMES);
 	printf("Got first prime factor, p = ");
 	bignum_print(p);
-	printf(" ... ");
+	printf(" (%.3f seconds, %ld candidates) ... ", seconds[0], candidates[0]);
 	getchar();
 	
-	randPrime(FACTOR_DIGITS, q);
 	printf("Got second prime factor, q = ");
 	bignum_print(q);
-	printf(" ... ");
+	printf(" (%.3f seconds, %ld candidates) ... ", seconds[1], candidates[1]);
 	getchar();
 	
+	STATS_PHASE_START();
 	bignum_multiply(n, p, q);
+	STATS_PHASE_END(STAT_MODULUS);
 	printf("Got modulus, n = pq = ");
 	bignum_print(n);
 	printf(" ... ");
 	getchar();
 	
+	STATS_PHASE_START();
 	bignum_subtract(temp1, p, &NUMS[1]);
 	bignum_subtract(temp2, q, &NUMS[1]);
 	bignum_multiply(phi, temp1, temp2); /* phi = (p - 1) * (q - 1) */
+	STATS_PHASE_END(STAT_MODULUS);
 	printf("Got totient, phi = ");
 	bignum_print(phi);
 	printf(" ... ");
 	getchar();
 	
+	STATS_PHASE_START();
 	randExponent(phi, EXPONENT_MAX, e);
+	STATS_PHASE_END(STAT_EXPONENT);
 	printf("Chose public exponent, e = ");
 	bignum_print(e);
 	printf("\nPublic key is (");
@@ -899,7 +4075,10 @@ int main(void) {
 	printf(") ... ");
 	getchar();
 	
+	STATS_PHASE_START();
 	bignum_inverse(e, phi, d);
+	key = initPrivateKey(p, q, d);
+	STATS_PHASE_END(STAT_PRIVATE);
 	printf("Calculated private exponent, d = ");
 	bignum_print(d);
 	printf("\nPrivate key is (");
@@ -909,52 +4088,68 @@ int main(void) {
 	printf(") ... ");
 	getchar();
 	
-	/* Compute maximum number of bytes that can be encoded in one encryption */
-	bytes = -1;
-	bignum_fromint(shift, 1 << 7); /* 7 bits per char */
-	bignum_fromint(bbytes, 1);
-	while(bignum_less(bbytes, n)) {
-		bignum_imultiply(bbytes, shift); /* Shift by one byte, NB: we use bitmask representative so this can actually be a shift... */
-		bytes++;
-	}
+	/* Compute maximum number of bytes that can be encoded in one encryption, packBits bits
+	 * per char and the packed block has to stay below n */
+	bytes = (bignum_bitlength(n) - 1) / packBits;
 
 	printf("Opening file \"text.txt\" for reading\n");
-	f = fopen("text.txt", "r");
+	f = fopen("text.txt", "rb");
 	if(f == NULL) {
 		printf("Failed to open file \"text.txt\". Does it exist?\n");
 		return EXIT_FAILURE;
 	}
-	len = readFile(f, &buffer, bytes); /* len will be a multiple of bytes, to send whole chunks */
 	
-	printf("File \"text.txt\" read successfully, %d bytes read. Encoding byte stream in chunks of %d bytes ... ", len, bytes);
+	printf("File \"text.txt\" opened successfully. Encoding byte stream in chunks of %d bytes ... ", bytes);
 	getchar();
 	printf("\n");
-	encoded = encodeMessage(len, bytes, buffer, e, n);
-	printf("\n\nEncoding finished successfully ... ");
+	/* The file is streamed through fixed buffers, the cryptogram kept in a temporary file.
+	 * It is written in decimal here so it can be shown. */
+	cipherFormat = CIPHER_DECIMAL;
+	cipher = tmpfile();
+	STATS_PHASE_START();
+	len = encryptStream(f, cipher, bytes, e, n);
+	STATS_PHASE_END(STAT_ENCRYPT);
+	fclose(f);
+	rewind(cipher);
+	while((r = fread(copy, 1, BUF_SIZE, cipher)) > 0) fwrite(copy, 1, r, stdout);
+	printf("\n\nEncoding finished successfully, %lld bytes encoded ... ", len);
 	getchar();
 	
 	printf("Decoding encoded message ... ");
 	getchar();
 	printf("\n");
-	decoded = decodeMessage(len/bytes, bytes, encoded, d, n);
+	rewind(cipher);
+	STATS_PHASE_START();
+	if(decryptStream(cipher, stdout, bytes, key) < 0) printf("Cryptogram is malformed!");
+	STATS_PHASE_END(STAT_DECRYPT);
+	fclose(cipher);
 	printf("\n\nFinished RSA demonstration!");
 	
-	/* Eek! This is why we shouldn't of calloc'd those! */
-	for(i = 0; i < len/bytes; i++) free(encoded[i].data);
-	free(encoded);
-	free(decoded);
-	free(buffer);
 	bignum_deinit(p);
 	bignum_deinit(q);
 	bignum_deinit(n);
 	bignum_deinit(phi);
 	bignum_deinit(e);
 	bignum_deinit(d);
-	bignum_deinit(bbytes);
-	bignum_deinit(shift);
 	bignum_deinit(temp1);
 	bignum_deinit(temp2);
-	fclose(f);
+	deinitPrivateKey(key);
 	
 	return EXIT_SUCCESS;
 }
+
+/**
+ * Run the command named on the command line, or the demonstration if there is none.
+ * RSA_THREADS in the environment sets threadCount.
+ */
+int main(int argc, char** argv) {
+	seedRandom();
+	if(getenv("RSA_THREADS") != NULL) threadCount = atoi(getenv("RSA_THREADS"));
+	if(argc < 2) return demo();
+	if(strcmp(argv[1], "keygen") == 0) return keygenCommand(argv[0], argc - 2, argv + 2);
+	if(strcmp(argv[1], "encrypt") == 0) return encryptCommand(argv[0], argc - 2, argv + 2);
+	if(strcmp(argv[1], "decrypt") == 0) return decryptCommand(argv[0], argc - 2, argv + 2);
+	if(strcmp(argv[1], "bench") == 0) return benchCommand(argv[0], argc - 2, argv + 2);
+	return usage(argv[0]);
+}
+#endif